@@ -1,4 +1,7 @@
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,59 +17,520 @@
 #include <locale.h>
 #include <time.h>
 #include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+
+#include "arg.h"
+
+/* An io_uring engine for plain HTTP, in place of epoll and sendfile(); needs Linux 5.19. */
+#ifndef BRICK_URING
+# define BRICK_URING 0
+#endif
+
+#ifndef BRICK_EPOLL
+# if defined(__linux__) && !BRICK_URING
+#  define BRICK_EPOLL 1
+# else
+#  define BRICK_EPOLL 0
+# endif
+#endif
+
+#if BRICK_EPOLL
+# include <sys/epoll.h>
+#endif
+
+#ifndef BRICK_SENDFILE
+# if defined(__linux__) && !BRICK_URING
+#  define BRICK_SENDFILE 1
+# else
+#  define BRICK_SENDFILE 0
+# endif
+#endif
+
+#if BRICK_SENDFILE
+# include <sys/sendfile.h>
+#endif
+
+#if BRICK_URING
+# if BRICK_EPOLL || BRICK_SENDFILE || BRICK_TLS
+#  error "BRICK_URING replaces epoll and sendfile(), and serves plain HTTP only"
+# endif
+# include <linux/io_uring.h>
+#endif
+
+/* Plain poll() is what is left without either. */
+#define BRICK_POLL (!BRICK_EPOLL && !BRICK_URING)
+
+#ifndef MSG_MORE
+# define MSG_MORE 0
+#endif
+
+#ifndef BRICK_THREADS
+# define BRICK_THREADS 1
+#endif
+
+#if BRICK_THREADS
+# include <pthread.h>
+#endif
+
+#ifdef __linux__
+# include <sys/syscall.h>
+# if defined(__has_include)
+#  if __has_include(<linux/openat2.h>)
+#   include <linux/openat2.h>
+#  endif
+# endif
+#endif
+
+#ifndef BRICK_DEBUG
+# define BRICK_DEBUG 0
+#endif
+
+/* Chatter about every connection; compiled in but optimized away unless BRICK_DEBUG is set. */
+#define debug(...) do { if (BRICK_DEBUG) printf(__VA_ARGS__); } while (0)
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
 
 #if BRICK_TLS
 # include <tls.h>
-# define NUM_ARGS 4
+# define NUM_ARGS 3
 #else
-# define NUM_ARGS 1
+# define NUM_ARGS 0
 #endif
 
 #define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
 
-#define NUM_PORTALS 1
-#define MAX_CONNS   1000
+#define MAX_PORTALS 16
+#define MAX_WORKERS 256
+#define DEF_CONNS   1000    /* default for -m */
+#define MAX_CONNS   1000000
 #define SCRATCH     2048
 #define MAX_PATH    200
 #define MAX_HEADER  200
+#define MAX_EVENTS  256
+#define MAX_RANGES  8
+#define HEADER_SLOTS 32 /* hash table for recognized header names, must be a power of two */
+#define SEND_CHUNK  (1 << 20)
+#if BRICK_URING
+# define PAYLOAD_BUF 65536 /* what each read and send of the payload moves; there is no TLS to fit */
+#else
+# define PAYLOAD_BUF 16384 /* also the largest TLS record */
+#endif
+
+#define SMALL_RECORD 1400 /* fits a single TCP segment including TLS overhead */
+#define RECORD_RAMP  65536
+
+#define FILE_CACHE  512  /* open files kept around */
+#define FILE_HASH   1024 /* must be a power of two */
+#define REVALIDATE  1    /* seconds before a cached file is checked for changes again */
+#define SMALL_FILE  (16 << 10) /* files up to this size get their whole response cached */
+#define RESP_CACHE  (4 << 20)  /* memory for cached responses */
+
+#define POOL_KEEP   256 /* idle buffers of each size kept for reuse */
+#define SPARE_FDS   (FILE_CACHE + MAX_PORTALS + IO_THREADS + 16)
+
+#define IO_THREADS  4   /* threads for file I/O that might have to wait for the disk */
+#define READ_AHEAD  (2 << 20) /* how far a download is read ahead once it has missed the page cache */
+#define MAX_RESOLVES 4  /* trips to the I/O threads per request before we just block */
+
+#define RING_ENTRIES 1024 /* io_uring submission queue */
+#define RECV_BUFS   1024  /* buffers provided for receives; past that, requests are read() */
+
+#define TIMER_TICK  250 /* milliseconds */
+#define WHEEL_BITS  6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 /* covers 2^24 ticks, about 48 days */
+
+#define REQUEST_TIMEOUT 10 /* seconds from the first byte of a request until it must be complete */
+#define IDLE_TIMEOUT    30 /* seconds a kept-alive connection may wait for its next request */
+#define SEND_WINDOW     10 /* seconds over which a response must make at least MIN_RATE progress */
+#define MIN_RATE        1024 /* bytes per second */
+#define DUMP_TIMEOUT    1000 /* milliseconds the supervisor waits for the workers' metrics */
+
+#define LIMIT_BURST 2 /* seconds' worth of -r and -b a client may use up at once */
+
+#define TICKET_LIFETIME 7200 /* seconds */
+#define TICKET_ROTATE   3600
+
+#define LOG_RING    (1 << 16) /* bytes of access log held back between writes, must be a power of two */
+#define LOG_LINE    (4 * MAX_PATH + 256) /* room for a fully escaped path */
+
+#define HIST_SUB    4  /* linear buckets per power of two, must be a power of two */
+#define HIST_MAJOR  32 /* powers of two of microseconds covered */
+#define HIST_BUCKETS (HIST_MAJOR * HIST_SUB)
 
 #define SHUTDOWN    0x1
 #define RECONFIGURE 0x2
+#define DUMP_METRICS 0x4
+
+enum phase { REQUEST, RESPONSE, PAYLOAD, NUM_PHASES };
+
+enum job_kind { RESOLVE, PREFETCH, NUM_JOB_KINDS };
+
+enum limit { REQUEST_LIMIT, BYTE_LIMIT, CONN_LIMIT, NUM_LIMITS };
+
+enum { HOST, ACCEPT_ENCODING, RANGE, IF_RANGE, IF_NONE_MATCH, IF_MODIFIED_SINCE, NUM_HEADERS };
+
+/* Content codings we can serve from precompressed sidecar files, in order of preference. */
+static const struct coding {
+	const char *name;
+	const char *suffix;
+	const char *headers;
+} codings[] = {
+	{ "identity", "",     "" },
+	{ "br",       ".br",  "Content-Encoding: br\r\nVary: Accept-Encoding\r\n" },
+	{ "zstd",     ".zst", "Content-Encoding: zstd\r\nVary: Accept-Encoding\r\n" },
+	{ "gzip",     ".gz",  "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n" },
+};
+
+#define NUM_CODINGS (int) (sizeof codings / sizeof *codings)
+
+/* Each status line together with the fixed headers up to the Date value. */
+#define STATUS_HEAD(code, name) "HTTP/1.1 " #code " " name "\r\nServer: brick\r\nDate: "
+#define STATUS(code, name) { code, name, STATUS_HEAD(code, name), sizeof STATUS_HEAD(code, name) - 1 }
+
+static const struct status {
+	int code;
+	const char *name;
+	const char *head;
+	size_t head_len;
+} statuses[] = {
+	STATUS(200, "OK"),
+	STATUS(206, "Partial Content"),
+	STATUS(304, "Not Modified"),
+	STATUS(400, "Bad Request"),
+	STATUS(404, "File Not Found"),
+	STATUS(416, "Range Not Satisfiable"),
+	STATUS(429, "Too Many Requests"),
+};
+
+/* An open file and what we know about it, shared by all connections serving it. */
+struct file {
+	struct file *next;          /* hash chain */
+	struct file *newer, *older; /* LRU order */
+	const char *mime;
+	off_t size;
+	struct timespec mtime;
+	dev_t dev;
+	ino_t ino;
+	time_t checked;
+	time_t sides_checked;
+	unsigned sides; /* bit mask of codings with a fresh sidecar file */
+	unsigned hash;
+	int coding;     /* this is a sidecar holding the original in that coding */
+	char *resp;     /* complete 200 response for small files, built on first use */
+	size_t resp_len;
+	size_t date_at; /* where the Date value sits in resp */
+	time_t dated;
+	int sending;    /* connections currently writing out resp */
+	int fd;
+	int refs;
+	int cached;     /* still reachable through file_table */
+	char etag[48];
+	char modified[30];
+	char headers[200]; /* validators plus whatever depends on the coding */
+	char head[400];    /* everything after the Date of a 200 response */
+	size_t head_len;
+	char path[MAX_PATH];
+};
+
+struct range {
+	off_t first;
+	off_t last;
+};
+
+/* File I/O handed to the I/O threads. They only ever touch the fields marked as theirs. */
+struct job {
+	struct job *next;
+	enum job_kind kind;
+	int idx;        /* connection waiting for the result, -1 once it is gone */
+	int done;
+	/* RESOLVE: open and stat path; fd, error and meta are filled in by the thread. */
+	int coding;
+	int fd;
+	int error;
+	struct stat meta;
+	char path[MAX_PATH];
+	/* PREFETCH: pull [off, off+len) of file into the page cache. */
+	struct file *file;
+	off_t off;
+	off_t len;
+};
+
+/* All connections coming from one address, for picking eviction victims quickly. */
+struct client {
+	struct client *next;   /* hash chain, or free list */
+	struct client *more;   /* neighbours among clients with the same count */
+	struct client *fewer;
+	struct peer *first[NUM_PHASES]; /* root of a pairing heap, the next victim in that phase */
+	struct sockaddr_storage addr;
+	unsigned hash;
+	int count;
+	/* Rate limits, as the time in microseconds at which the next unit would be on schedule. */
+	uint64_t req_tat;
+	uint64_t byte_tat;
+};
+
+/* The part of a connection the event loop never looks at. */
+struct peer {
+	struct sockaddr_storage addr;
+	struct client *client;
+	/* Pairing heap links: prev is the parent for a first child, the left sibling otherwise. */
+	struct peer *child;
+	struct peer *next;
+	struct peer *prev;
+	size_t key;     /* where it is filed, which can lag behind the connection */
+	uint64_t since; /* when it entered its phase; among equals the latest goes first */
+	int phase;
+};
 
-enum phase { REQUEST, RESPONSE, PAYLOAD };
+/* A deadline in the timer wheel. */
+struct timer {
+	struct timer *next;
+	struct timer **pprev; /* NULL while not armed */
+	uint64_t at;          /* in ticks */
+	unsigned char level;
+	unsigned char slot;
+};
 
+/* Fields are ordered roughly by how often the event loop needs them. */
 struct conn {
-	char *scratch;
+	short events; /* what the current phase is waiting for */
+	short ready;  /* readiness that has not been used up yet */
+	int sock;
+	enum phase phase;
+	int pos;      /* index into live[] */
+	char *out;    /* what conn_write() sends from */
+	size_t offset;
+	size_t length;
 #if BRICK_TLS
 	struct tls *tls;
+	int handshaken;
 #endif
-	struct sockaddr_storage addr;
-	size_t offset;
-	size_t length;
+	/* Buffers come from the pools and are only held while they are needed. */
+	char *in;     /* request bytes, possibly several pipelined requests */
+	size_t in_len;
+	char *scratch;
+	char *buf;    /* payload buffer */
 	size_t content_length;
-	enum phase phase;
+	size_t sent;  /* payload bytes sent in the current response */
+	size_t bytes; /* everything sent for the current response, for the log */
+	uint64_t started;  /* microseconds, when the first byte of the request came in */
+	uint64_t phase_at; /* when the current phase began */
+	int status;
+	off_t src_off;
+	struct file *file;
+	int shared;   /* out points into file->resp */
+	int buffered; /* payload has to be copied through scratch */
+	struct range *ranges; /* only for multipart/byteranges */
+	int nranges;
+	int range;    /* next part to start, nranges for the closing boundary */
+	struct job *job;
+	int parked;   /* waiting for job rather than the socket */
+	int resolves; /* jobs this request has waited for so far */
+	off_t warm_from; /* the file is known to be in the page cache in here */
+	off_t warm_to;
+	struct timer timer;
+	size_t window_from; /* bytes already sent when the current SEND_WINDOW began */
+	int throttled; /* events held back while the client is over its byte rate */
+	uint32_t gen; /* bumped whenever the slot is freed, so stale events and completions can be told apart */
+	int corked;   /* the last send had MSG_MORE, so the kernel may be sitting on a partial segment */
+#if BRICK_URING
+	int recving;  /* a receive is in flight */
+	int writing;  /* sends and payload reads in flight; POLLOUT is ready once there are none */
+	char *held;   /* what the last receive brought in that conn_read() has yet to take */
+	size_t held_len;
+	int held_bid; /* the provided buffer it sits in */
+#endif
+};
+
+#if BRICK_URING
+/* What a closed connection leaves to its operations still in flight, until the last of them completes. */
+struct orphan {
+	struct orphan *next;
+	uint64_t key; /* generation and slot, as in user_data */
+	int ops;
 	int sock;
-	int src;
+	char *scratch;
+	char *buf;
+	struct file *file;
+	int shared;
+};
+#endif
+
+/* Free buffers of one size, linked through their first bytes. */
+struct pool {
+	size_t size;
+	void *free;
+	int nfree;
 };
 
-static const char **args;
+char *argv0;
+
+static char **args;
 static volatile int global_flags;
+static int is_worker;
 static int nconns;
-
-static struct pollfd  all_pfds[NUM_PORTALS + MAX_CONNS];
-static struct conn    conns[MAX_CONNS];
-static struct pollfd *conn_pfds = all_pfds + NUM_PORTALS;
+static int max_conns = DEF_CONNS;
+/* Per-client limits given with -r, -b and -l; 0 for none. */
+static int client_reqs;
+static int client_bytes;
+static int client_conns;
+/* The most a single send may move under -b. */
+static size_t send_budget = SIZE_MAX;
+
+static int            portals[MAX_PORTALS];
+static int            nportals;
+static struct conn   *conns;
+static struct peer   *peers;
+/* A permutation of all connection slots. The first nconns are in use. */
+static int           *live;
+#if BRICK_EPOLL
+static int            epfd;
+#elif BRICK_POLL
+static struct pollfd *all_pfds;
+static struct pollfd *conn_pfds;
+#else
+/* The rings shared with the kernel. Submissions are published at the next io_uring_enter(). */
+static int            ring_fd;
+static unsigned      *sq_head, *sq_tail, sq_mask, sq_entries;
+static unsigned       sq_local;
+static struct io_uring_sqe *sqes;
+static unsigned      *cq_head, *cq_tail, cq_mask;
+static struct io_uring_cqe *cqes;
+/* Buffers the kernel picks from to receive requests into, SCRATCH bytes each. */
+static struct io_uring_buf_ring *recv_ring;
+static char          *recv_bufs;
+static unsigned       recv_count;
+static struct orphan *orphans;
+#endif
+static struct pool    small_bufs   = { .size = SCRATCH + MAX_PATH };
+static struct pool    payload_bufs = { .size = PAYLOAD_BUF };
 #if BRICK_TLS
+/* Ticket keys live in memory shared by all workers, so any of them can resume any session. */
+struct tickets {
+	unsigned seq; /* odd while somebody is writing */
+	uint32_t rev;
+	time_t time;
+	unsigned char sid[TLS_MAX_SESSION_ID_LENGTH];
+	unsigned char keys[2][TLS_TICKET_KEY_SIZE]; /* previous & current */
+};
+
 static struct tls    *portal_tls;
+/* Ports and socket paths given with -p, and which portals they make plain HTTP. */
+static const char    *plain_names[MAX_PORTALS];
+static int            nplain_names;
+static int            plain_portals[MAX_PORTALS];
+static struct tls_config *tls_cfg;
+static struct tickets *tickets;
+static uint32_t       ticket_rev;
+static unsigned long  full_handshakes;
+static unsigned long  resumed_handshakes;
 #endif
 
-static const char *req_keys[] = {
-	"Host",
-	NULL
+static struct client *clients;
+static struct client *free_clients;
+/* Clients without connections whose rate limits have yet to run out, newest first, linked through more & fewer. */
+static struct client *idle_clients;
+static struct client *oldest_idle;
+static struct client **client_table;
+static unsigned       client_mask;
+/* Clients by number of connections; by_count[0] is unused. */
+static struct client **by_count;
+static int            max_count;
+static uint64_t       phase_entries; /* orders ties between eviction candidates */
+
+#if BRICK_THREADS
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond  = PTHREAD_COND_INITIALIZER;
+static struct job    *queued_jobs;
+static struct job   **queued_tail = &queued_jobs;
+static struct job    *done_jobs;
+#endif
+static int            io_threads;
+static int            wake_fds[2] = { -1, -1 }; /* the I/O threads poke the event loop through this */
+
+/* Hierarchical timing wheel: level l holds timers due within WHEEL_SLOTS^(l+1) ticks. */
+static struct timer  *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t       wheel_bits[WHEEL_LEVELS]; /* which slots are non-empty */
+static uint64_t       wheel_now; /* the last tick that has been run */
+static int            ntimers;
+
+static struct file   *file_table[FILE_HASH];
+static struct file   *newest_file;
+static struct file   *oldest_file;
+static int            nfiles;
+static size_t         resp_bytes;
+
+static const char *req_keys[NUM_HEADERS] = {
+	[HOST]            = "Host",
+	[ACCEPT_ENCODING] = "Accept-Encoding",
+	[RANGE]           = "Range",
+	[IF_RANGE]        = "If-Range",
+	[IF_NONE_MATCH]   = "If-None-Match",
+	[IF_MODIFIED_SINCE] = "If-Modified-Since",
+};
+/* Index + 1 of the key whose name hashes to each slot, 0 if none. */
+static signed char key_slots[HEADER_SLOTS];
+
+/* A piece of the request buffer. */
+struct view {
+	size_t off;
+	size_t len;
 };
 
-static char req_headers[sizeof req_keys / sizeof *req_keys - 1][MAX_HEADER];
+/* The request being processed. Header values are NUL-terminated in place. */
+static struct {
+	const char *buf;
+	struct view path;
+	struct view headers[NUM_HEADERS];
+} req;
+
 static char req_path[MAX_PATH];
+static char boundary[17];
+static char multipart_type[64];
+
+static time_t cur_time;
+static char   cur_date[30]; /* cur_time as an HTTP date */
+static size_t cur_date_len;
+static char   log_date[30]; /* the same in Common Log Format */
+
+/* Access log lines waiting to be written. Only the event loop ever touches it, so no locking is needed. */
+static char     log_ring[LOG_RING];
+static unsigned log_head, log_tail;
+static unsigned long log_dropped;
+static time_t   log_flushed;
+
+/* Log-linear latency buckets, in the spirit of HDR histograms. The last one catches everything beyond. */
+struct histogram {
+	unsigned long counts[HIST_BUCKETS + 1];
+	unsigned long count;
+	uint64_t sum; /* microseconds */
+};
+
+static struct {
+	unsigned long requests[sizeof statuses / sizeof *statuses];
+	unsigned long long bytes;
+	unsigned long accepted;
+	unsigned long evicted;
+	unsigned long jobs[NUM_JOB_KINDS];
+	unsigned long timeouts[NUM_PHASES];
+	unsigned long limited[NUM_LIMITS];
+	struct histogram phases[NUM_PHASES];
+} metrics;
+static int worker_id;
+static int metrics_fd = 2; /* with -w, a pipe to the supervisor, which merges all workers' metrics */
 
 static const char *mime_types[] = {
         ".xml",   "application/xml; charset=utf-8",
@@ -100,279 +564,1740 @@ static const char *mime_types[] = {
 static void
 usage(void)
 {
-	printf("usage: %s"
+	printf("usage: %s [-w workers] [-c] [-m connections] [-r requests/s] [-b bytes/s] [-l connections]"
 #if BRICK_TLS
-		" ca-file cert-file key-file"
+		" [-p port|path ...] ca-file cert-file key-file"
 #endif
-		"\n", args[0]);
+		"\n", argv0);
 }
 
-static int
-same_addr(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+static const char *
+mime_type(const char *path, size_t pathlen)
 {
-	if (a->ss_family != b->ss_family) return 0;
-	switch (a->ss_family) {
-	case AF_INET:
-		return ((struct sockaddr_in *) a)->sin_addr.s_addr ==
-			((struct sockaddr_in *) b)->sin_addr.s_addr;
-	default: /* AF_INET6 */
-		return memcmp(((struct sockaddr_in6 *) a)->sin6_addr.s6_addr,
-			((struct sockaddr_in6 *) b)->sin6_addr.s6_addr,
-			sizeof (((struct sockaddr_in6 *) a)->sin6_addr.s6_addr)) == 0;
+	for (int i = 0; mime_types[i]; i += 2) {
+		size_t len = strlen(mime_types[i]);
+		if (pathlen < len) continue;
+		if (!memcmp(path + pathlen - len, mime_types[i], len)) {
+			return mime_types[i+1];
+		}
 	}
+	return "application/octet-stream";
 }
 
-static int
-evict(void)
+static unsigned
+hash_path(const char *path, int coding)
 {
-	int evicted = -1;
-	int maxcnt = 0;
-	for (int i = 0; i < nconns; i++) {
-		int sel = i, cnt = 0;
-		for (int j = 0; j < nconns; j++) {
-			if (!same_addr(&conns[sel].addr, &conns[j].addr)) continue;
-			cnt++;
-			if (conns[j].phase < conns[sel].phase) {
-				sel = j;
-			} else if (conns[j].phase == conns[sel].phase) {
-				int swap = 0;
-				switch (conns[sel].phase) {
-				case REQUEST:
-					swap = conns[j].length < conns[sel].length;
-					break;
-				case RESPONSE:
-					/* TODO prioritize status 200 responses */
-					swap = (conns[j].length - conns[j].offset) >
-						(conns[sel].length - conns[sel].offset);
-					break;
-				case PAYLOAD:
-					swap = conns[j].content_length > conns[sel].content_length;
-					break;
-				}
-				if (swap) sel = j;
-			}
-		}
-		if (cnt > maxcnt) {
-			evicted = sel;
-			maxcnt = cnt;
-		}
-	}
-	return evicted;
+	/* FNV-1a */
+	unsigned h = 2166136261u ^ coding;
+	while (*path) h = (h ^ (unsigned char) *path++) * 16777619u;
+	return h;
 }
 
 static void
-clr_conn(int idx)
+format_date(char *buf, size_t size, time_t t)
 {
-	struct conn *conn = &conns[idx];
-	close(conn->sock);
-	if (!(conn->src < 0)) close(conn->src);
-#if BRICK_TLS
-	tls_free(conn->tls);
-#endif
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(buf, size, "%a, %d %b %Y %T GMT", &tm);
 }
 
 static void
-del_conn(int idx)
+drop_response(struct file *file)
 {
-	printf("Closing a connection.\n");
-
-	char *scratch = conns[idx].scratch;
-	clr_conn(idx);
-	
-	nconns--;
-	conns[idx] = conns[nconns];
-	conn_pfds[idx] = conn_pfds[nconns];
-
-	memset(&conns[nconns], 0, sizeof (struct conn));
-	conns[nconns].scratch = scratch;
+	resp_bytes -= file->resp_len;
+	free(file->resp);
+	file->resp = NULL;
+	file->resp_len = 0;
 }
 
-static int
-set_conn(int idx, int fd, const struct sockaddr_storage *addr, socklen_t addrlen)
+static void
+free_file(struct file *file)
 {
-	struct conn *conn = &conns[idx];
+	close(file->fd);
+	if (file->resp) drop_response(file);
+	free(file);
+}
 
-	int flags = fcntl(fd, F_GETFL, 0);
-	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-#if BRICK_TLS
-	if (tls_accept_socket(portal_tls, &conn->tls, fd) < 0) {
-		fprintf(stderr, "tls_accept: %s (non-fatal)\n", tls_error(portal_tls));
-		close(fd);
-		return -1;
-	}
-#endif
+/* Make a file unreachable for new requests. It gets closed once the last connection lets go of it. */
+static void
+uncache_file(struct file *file)
+{
+	struct file **p = &file_table[file->hash & (FILE_HASH - 1)];
+	while (*p != file) p = &(*p)->next;
+	*p = file->next;
+	if (file->newer) file->newer->older = file->older;
+	else newest_file = file->older;
+	if (file->older) file->older->newer = file->newer;
+	else oldest_file = file->newer;
+	file->cached = 0;
+	nfiles--;
+	if (!file->refs) free_file(file);
+}
 
-	memcpy(&conn->addr, addr, addrlen);
-	conn->sock = fd;
-	conn->src = -1;
+static void
+put_file(struct file *file)
+{
+	if (!--file->refs && !file->cached) free_file(file);
+}
 
-	conn_pfds[idx].fd      = fd;
-	conn_pfds[idx].events  = POLLIN;
-	conn_pfds[idx].revents = 0;
-	
-	return 0;
+static int
+file_changed(const struct file *file, const struct stat *meta)
+{
+	return meta->st_dev != file->dev || meta->st_ino != file->ino ||
+		meta->st_size != file->size ||
+		meta->st_mtim.tv_sec != file->mtime.tv_sec ||
+		meta->st_mtim.tv_nsec != file->mtime.tv_nsec;
 }
 
 static void
-add_conn(int fd, struct sockaddr_storage *addr, socklen_t addrlen)
+set_file_headers(struct file *file)
 {
-	printf("Accepted a new connection.\n");
-	if (nconns >= MAX_CONNS) {
-		del_conn(evict());
-	}
-	if (set_conn(nconns, fd, addr, addrlen) < 0) return;
-	nconns++;
+	snprintf(file->headers, sizeof file->headers,
+		"ETag: %s\r\n"
+		"Last-Modified: %s\r\n"
+		"%s",
+		file->etag, file->modified,
+		file->coding ? codings[file->coding].headers :
+		file->sides ? "Vary: Accept-Encoding\r\n" : "");
+	file->head_len = snprintf(file->head, sizeof file->head,
+		"\r\n"
+		"Content-Type: %s\r\n"
+		"Accept-Ranges: bytes\r\n"
+		"%s"
+		"Content-Length: %llu\r\n"
+		"\r\n",
+		file->mime, file->headers, (long long unsigned) file->size);
 }
 
-static int
-conn_read(int idx)
+/* pread() that fails with EAGAIN rather than wait for the disk, where the system can do that. */
+static ssize_t
+pread_nowait(int fd, void *buf, size_t len, off_t off)
 {
-	struct conn *conn = &conns[idx];
-	if (conn->length == SCRATCH) return -1;
-#if BRICK_TLS
-	ssize_t n = tls_read(conn->tls, conn->scratch + conn->length, SCRATCH - conn->length);
-	switch (n) {
-	case -1: fprintf(stderr, "tls_read: %s (non-fatal)\n", tls_error(conn->tls)); return -1;
-	case TLS_WANT_POLLIN:  conn_pfds[idx].events = POLLIN;  break;
-	case TLS_WANT_POLLOUT: conn_pfds[idx].events = POLLOUT; break;
-	default: conn->length += n;
-	}
-	return 0;
-#else
-	for (;;) {
-		ssize_t n = read(conn->sock, conn->scratch + conn->length, SCRATCH - conn->length);
-		if (!n) return -1;
-		if (n > 0) {
-			conn->length += n;
-			return 0;
-		}
-		switch (errno) {
-		case EINTR: continue;
-#if EAGAIN != EWOULDBLOCK
-		case EAGAIN:
-#endif
-		case EWOULDBLOCK: return 0;
-		default: return -1;
-		}
+#ifdef RWF_NOWAIT
+	if (io_threads) {
+		struct iovec iov = { buf, len };
+		ssize_t n = preadv2(fd, &iov, 1, off, RWF_NOWAIT);
+		/* Not every file system can tell. */
+		if (n >= 0 || errno != EOPNOTSUPP) return n;
 	}
 #endif
+	return pread(fd, buf, len, off);
 }
 
+/* Opens path only if that can be done from the dentry and inode caches, failing with EAGAIN otherwise. */
 static int
-conn_write(int idx)
+open_cached(const char *path)
 {
-	struct conn *conn = &conns[idx];
-#if BRICK_TLS
-	ssize_t n = tls_write(conn->tls, conn->scratch + conn->offset, conn->length - conn->offset);
-	switch (n) {
-	case -1: fprintf(stderr, "tls_write: %s (non-fatal)\n", tls_error(conn->tls)); return -1;
-	case TLS_WANT_POLLIN:  conn_pfds[idx].events = POLLIN;  break;
-	case TLS_WANT_POLLOUT: conn_pfds[idx].events = POLLOUT; break;
-	default: conn->offset += n;
+#if defined(SYS_openat2) && defined(RESOLVE_CACHED)
+	static int unsupported;
+	if (!unsupported) {
+		struct open_how how = { .flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_CACHED };
+		int fd = syscall(SYS_openat2, AT_FDCWD, path, &how, sizeof how);
+		if (fd >= 0 || (errno != ENOSYS && errno != EINVAL)) return fd;
+		unsupported = 1;
 	}
-	return 0;
 #else
-	for (;;) {
-		ssize_t n = write(conn->sock, conn->scratch + conn->offset, conn->length - conn->offset);
-		if (n >= 0) {
-			conn->offset += n;
-			return 0;
-		}
-		switch (errno) {
-		case EINTR: continue;
-#if EAGAIN != EWOULDBLOCK
-		case EAGAIN:
-#endif
-		case EWOULDBLOCK: return 0;
-		default: return -1;
-		}
-	}
+	(void) path;
 #endif
+	errno = EAGAIN;
+	return -1;
 }
 
 static void
-switch_phase(int idx, enum phase phase)
+free_job(struct job *job)
+{
+	if (job->kind == RESOLVE && job->fd >= 0) close(job->fd);
+	if (job->kind == PREFETCH) put_file(job->file);
+	free(job);
+}
+
+/* Lets go of a connection's job. One that is still running is left for finish_jobs() to clean up. */
+static void
+drop_job(int idx)
 {
 	struct conn *conn = &conns[idx];
-	conn->phase  = phase;
-	conn->offset = 0;
-	conn->length = 0;
-	conn_pfds[idx].events = phase == REQUEST ? POLLIN : POLLOUT;
+	struct job *job = conn->job;
+	if (!job) return;
+	conn->job = NULL;
+	conn->parked = 0;
+	if (job->done) free_job(job);
+	else job->idx = -1;
 }
 
-static int
-parse_http(const char *buf, const char **keys, char (*values)[MAX_HEADER], char *path)
+static void
+submit(int idx, struct job *job)
 {
-	const char *p, *q;
-	size_t n;
-	int i;
+	drop_job(idx);
+	job->idx = idx;
+	conns[idx].job = job;
+	metrics.jobs[job->kind]++;
+#if BRICK_THREADS
+	pthread_mutex_lock(&io_lock);
+	*queued_tail = job;
+	queued_tail = &job->next;
+	pthread_cond_signal(&io_cond);
+	pthread_mutex_unlock(&io_lock);
+#endif
+}
 
-	for (i = 0; keys[i]; i++) {
-		values[i][0] = 0;
-	}
-	path[0] = 0;
-	p = buf;
-	
-	/* Ensure the used method is GET. */
-	if (strncmp(p, "GET ", 4)) return -1;
-	p += 4;
-	
-	/* Parse the target path. */
-	if (!(q = strchr(p, ' '))) return -1;
-	if (p == q) return -1;
-	n = MIN((size_t) (q-p), MAX_PATH-1);
-	memcpy(path, p, n);
-	path[n] = 0;
-	p = q + 1;
-	
-	/* Parse the HTTP version & end of line. */
-	if (strncmp(p, "HTTP/1.1\r\n", 10)) return -1;
-	p += 10;
-	
-	/* Assume each line corresponds to a header field. */
-	while (*p) {
-		/* Use linear search to identify the given header field. */
-		for (i = 0; keys[i]; i++) {
-			if (!strcasecmp(p, keys[i])) {
-				p += strlen(keys[i]);
-				break;
+#if BRICK_THREADS
+/* Runs on an I/O thread. */
+static void
+run_job(struct job *job)
+{
+	switch (job->kind) {
+	case RESOLVE:
+		job->fd = open(job->path, O_RDONLY | O_CLOEXEC);
+		if (job->fd >= 0 && fstat(job->fd, &job->meta) < 0) {
+			close(job->fd);
+			job->fd = -1;
+		}
+		job->error = errno;
+		/* check_sidecars() is about to stat these; make sure that doesn't go to the disk either. */
+		if (job->fd >= 0 && !job->coding) {
+			for (int c = 1; c < NUM_CODINGS; c++) {
+				char path[MAX_PATH];
+				struct stat meta;
+				if (snprintf(path, sizeof path, "%s%s", job->path, codings[c].suffix) < (int) sizeof path) {
+					stat(path, &meta);
+				}
 			}
 		}
-
-		/* If we don't recognize the header field, we silently ignore it. */
-		if (!keys[i]) {
-			if (!(q = strstr(p, "\r\n"))) return -1;
-			p = q + 2;
-			continue;
+		break;
+	case PREFETCH: {
+		/* Reading it is the only portable way to know it has actually arrived. */
+		char buf[1 << 16];
+		off_t off = job->off, end = job->off + job->len;
+		posix_fadvise(job->file->fd, off, job->len, POSIX_FADV_WILLNEED);
+		while (off < end) {
+			ssize_t n = pread(job->file->fd, buf, MIN((off_t) sizeof buf, end - off), off);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			off += n;
 		}
+		break;
+	}
+	default:
+		break;
+	}
+}
 
-		/* Enforce the colon after the field name & skip whitespace. */
-		if (*p != ':') return -1;
-		p++;
-		while (*p == ' ' || *p == '\t') p++;
+static void *
+io_thread(void *arg)
+{
+	(void) arg;
+	for (;;) {
+		pthread_mutex_lock(&io_lock);
+		while (!queued_jobs) pthread_cond_wait(&io_cond, &io_lock);
+		struct job *job = queued_jobs;
+		if (!(queued_jobs = job->next)) queued_tail = &queued_jobs;
+		pthread_mutex_unlock(&io_lock);
+
+		run_job(job);
+
+		pthread_mutex_lock(&io_lock);
+		int wake = !done_jobs;
+		job->next = done_jobs;
+		done_jobs = job;
+		pthread_mutex_unlock(&io_lock);
+		if (wake) write(wake_fds[1], "", 1);
+	}
+	return NULL;
+}
+#endif
 
-		/* Copy the field's value and advance. */
-		if (!(q = strstr(p, "\r\n"))) return -1;
-		n = MIN((size_t) (q-p), MAX_HEADER-1);
-		memcpy(values[i], p, n);
-		values[i][n] = 0;
-		p = q + 2;
+static void
+start_io_threads(void)
+{
+#if BRICK_THREADS
+	if (pipe(wake_fds) < 0) {
+		fprintf(stderr, "pipe: %s (non-fatal)\n", strerror(errno));
+		return;
 	}
-	return 0;
+	for (int i = 0; i < 2; i++) {
+		fcntl(wake_fds[i], F_SETFL, fcntl(wake_fds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(wake_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	/* Signals are for the event loop only. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (int i = 0; i < IO_THREADS; i++) {
+		pthread_t thread;
+		int err = pthread_create(&thread, NULL, io_thread, NULL);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s (non-fatal)\n", strerror(err));
+			break;
+		}
+		pthread_detach(thread);
+		io_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+#endif
 }
 
+/* Opens and stats path without waiting for the disk on the event loop. If that can't be done,
+ * an I/O thread takes over and this fails with EINPROGRESS. Once the connection comes back
+ * with the same path, the thread's result is handed out. */
 static int
-sanitize_path(char *path)
+open_file(int idx, const char *path, int coding, struct stat *meta)
 {
-	char *r = path, *w = path;
-	/* Paths must start with a slash. */
-	if (*r != '/') return -1;
-	/* Go through the path step-by-step. */
-	for (;;) {
-		/* Invariant: the path contained a slash right before the current character. */
-		/* Remove duplicate slashes, they are confusing. */
-		while (*r == '/') r++;
-		/* Refuse to access any file or directory that starts with a dot. Especially '../'! */
+	struct conn *conn = &conns[idx];
+	struct job *job = conn->job;
+	if (job && job->done && job->kind == RESOLVE && job->coding == coding && !strcmp(job->path, path)) {
+		int fd = job->fd, error = job->error;
+		*meta = job->meta;
+		conn->job = NULL;
+		job->fd = -1;
+		free_job(job);
+		errno = error;
+		return fd;
+	}
+
+	int fd = open_cached(path);
+	if (fd < 0 && errno == EAGAIN) {
+		if (io_threads && conn->resolves < MAX_RESOLVES && (job = calloc(1, sizeof *job))) {
+			job->kind   = RESOLVE;
+			job->coding = coding;
+			job->fd     = -1;
+			strcpy(job->path, path);
+			conn->resolves++;
+			submit(idx, job);
+			errno = EINPROGRESS;
+			return -1;
+		}
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+	}
+	if (fd >= 0 && fstat(fd, meta) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/* Looks up path in the cache, opening it if needed. Returns NULL if it can't be served,
+ * with errno set to EINPROGRESS if the connection has to wait for an I/O thread first.
+ * A sidecar is cached separately from a direct request for the same path, as it's served differently. */
+static struct file *
+get_file(int idx, const char *path, int coding)
+{
+	struct stat meta;
+	time_t now = cur_time;
+	unsigned hash = hash_path(path, coding);
+	struct file *file = file_table[hash & (FILE_HASH - 1)];
+	while (file && (file->hash != hash || file->coding != coding || strcmp(file->path, path))) {
+		file = file->next;
+	}
+
+	int fd = -1;
+	if (file && now - file->checked >= REVALIDATE) {
+		fd = open_file(idx, path, coding, &meta);
+		if (fd < 0 && errno == EINPROGRESS) return NULL;
+		if (fd >= 0 && !file_changed(file, &meta)) {
+			close(fd);
+			file->checked = now;
+		} else {
+			uncache_file(file);
+			file = NULL;
+			if (fd < 0) return NULL;
+		}
+	}
+
+	if (file) {
+		/* Move to the front of the LRU list. */
+		if (file->newer) {
+			file->newer->older = file->older;
+			if (file->older) file->older->newer = file->newer;
+			else oldest_file = file->newer;
+			file->older = newest_file;
+			file->newer = NULL;
+			newest_file->newer = file;
+			newest_file = file;
+		}
+		file->refs++;
+		return file;
+	}
+
+	if (fd < 0 && (fd = open_file(idx, path, coding, &meta)) < 0) return NULL;
+	if (!S_ISREG(meta.st_mode) || !(file = calloc(1, sizeof *file))) {
+		close(fd);
+		return NULL;
+	}
+	/* Big files are mostly streamed front to back; let the kernel read ahead generously. */
+	if (meta.st_size > SMALL_FILE) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (nfiles >= FILE_CACHE) uncache_file(oldest_file);
+
+	strcpy(file->path, path);
+	file->mime    = mime_type(path, strlen(path) - strlen(codings[coding].suffix));
+	file->size    = meta.st_size;
+	file->mtime   = meta.st_mtim;
+	file->dev     = meta.st_dev;
+	file->ino     = meta.st_ino;
+	file->checked = now;
+	file->sides_checked = 0;
+	file->sides   = 0;
+	file->hash    = hash;
+	file->coding  = coding;
+	snprintf(file->etag, sizeof file->etag, "\"%llx-%llx%s%s\"",
+		(long long unsigned) meta.st_mtim.tv_sec * 1000000000 + meta.st_mtim.tv_nsec,
+		(long long unsigned) meta.st_size, coding ? "-" : "", coding ? codings[coding].name : "");
+	format_date(file->modified, sizeof file->modified, meta.st_mtim.tv_sec);
+	set_file_headers(file);
+	file->fd      = fd;
+	file->refs    = 1;
+	file->cached  = 1;
+
+	file->next = file_table[hash & (FILE_HASH - 1)];
+	file_table[hash & (FILE_HASH - 1)] = file;
+	file->newer = NULL;
+	file->older = newest_file;
+	if (newest_file) newest_file->newer = file;
+	else oldest_file = file;
+	newest_file = file;
+	nfiles++;
+	return file;
+}
+
+/* Finds out which precompressed versions of file exist and are at least as new. */
+static void
+check_sidecars(struct file *file)
+{
+	time_t now = cur_time;
+	if (now - file->sides_checked < REVALIDATE) return;
+
+	unsigned sides = 0;
+	for (int c = 1; c < NUM_CODINGS; c++) {
+		char path[MAX_PATH];
+		struct stat meta;
+		if (snprintf(path, sizeof path, "%s%s", file->path, codings[c].suffix) >= (int) sizeof path) continue;
+		if (stat(path, &meta) < 0 || !S_ISREG(meta.st_mode)) continue;
+		if (meta.st_mtim.tv_sec < file->mtime.tv_sec) continue;
+		if (meta.st_mtim.tv_sec == file->mtime.tv_sec && meta.st_mtim.tv_nsec < file->mtime.tv_nsec) continue;
+		sides |= 1 << c;
+	}
+
+	/* The cached response carries a Vary header or not, depending on this. */
+	if (sides != file->sides && file->resp) {
+		if (file->sending) return;
+		drop_response(file);
+	}
+	if (sides != file->sides) {
+		file->sides = sides;
+		set_file_headers(file);
+	}
+	file->sides_checked = now;
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* IPv6 hosts usually get a whole /64 to pick addresses from, so that is what makes one client. */
+static size_t
+v6_prefix(const struct in6_addr *addr)
+{
+	return IN6_IS_ADDR_V4MAPPED(addr) ? sizeof *addr : 8;
+}
+
+static int
+same_addr(const struct sockaddr_storage *a, const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family) return 0;
+	switch (a->ss_family) {
+	case AF_INET:
+		return ((struct sockaddr_in *) a)->sin_addr.s_addr ==
+			((struct sockaddr_in *) b)->sin_addr.s_addr;
+	case AF_UNIX:
+		/* Peers on Unix sockets are usually unnamed; they all count as the local host. */
+		return 1;
+	default: /* AF_INET6 */
+		return memcmp(((struct sockaddr_in6 *) a)->sin6_addr.s6_addr,
+			((struct sockaddr_in6 *) b)->sin6_addr.s6_addr,
+			v6_prefix(&((struct sockaddr_in6 *) a)->sin6_addr)) == 0;
+	}
+}
+
+static unsigned
+hash_addr(const struct sockaddr_storage *addr)
+{
+	const unsigned char *p, *end;
+	switch (addr->ss_family) {
+	case AF_INET:
+		p = (const void *) &((struct sockaddr_in *) addr)->sin_addr;
+		end = p + sizeof (struct in_addr);
+		break;
+	case AF_UNIX:
+		p = end = NULL;
+		break;
+	default: /* AF_INET6 */
+		p = (const void *) &((struct sockaddr_in6 *) addr)->sin6_addr;
+		end = p + v6_prefix(&((struct sockaddr_in6 *) addr)->sin6_addr);
+	}
+	/* FNV-1a */
+	unsigned h = 2166136261u ^ addr->ss_family;
+	while (p < end) h = (h ^ *p++) * 16777619u;
+	return h;
+}
+
+static void
+count_client(struct client *client, int delta)
+{
+	if (client->count) {
+		if (client->more) client->more->fewer = client->fewer;
+		if (client->fewer) client->fewer->more = client->more;
+		else by_count[client->count] = client->more;
+	}
+	client->count += delta;
+	if (client->count) {
+		client->fewer = NULL;
+		client->more = by_count[client->count];
+		if (client->more) client->more->fewer = client;
+		by_count[client->count] = client;
+		if (client->count > max_count) max_count = client->count;
+	}
+	while (max_count && !by_count[max_count]) max_count--;
+}
+
+/* Orders a client's connections in one phase, smallest first: the least advanced requests,
+ * the most outstanding responses. */
+static size_t
+victim_key(const struct conn *conn)
+{
+	switch (conn->phase) {
+	case REQUEST:  return conn->in_len;
+	case RESPONSE: return ~(conn->length - conn->offset); /* TODO prioritize status 200 responses */
+	default:       return ~conn->content_length; /* PAYLOAD */
+	}
+}
+
+/* Whether a should be evicted before b. */
+static int
+goes_first(const struct peer *a, const struct peer *b)
+{
+	return a->key != b->key ? a->key < b->key : a->since > b->since;
+}
+
+static struct peer *
+meld(struct peer *a, struct peer *b)
+{
+	if (!a) return b;
+	if (!b) return a;
+	if (goes_first(b, a)) {
+		struct peer *t = a;
+		a = b;
+		b = t;
+	}
+	b->prev = a;
+	b->next = a->child;
+	if (b->next) b->next->prev = b;
+	a->child = b;
+	return a;
+}
+
+/* Melds a list of siblings into one heap, in pairs from the left, then from the right. */
+static struct peer *
+meld_pairs(struct peer *list)
+{
+	struct peer *pairs = NULL;
+	while (list) {
+		struct peer *a = list, *b = a->next;
+		list = b ? b->next : NULL;
+		a->next = a->prev = NULL;
+		if (b) b->next = b->prev = NULL;
+		a = meld(a, b);
+		a->next = pairs;
+		pairs = a;
+	}
+	struct peer *root = NULL;
+	while (pairs) {
+		struct peer *a = pairs;
+		pairs = a->next;
+		a->next = NULL;
+		root = meld(a, root);
+	}
+	return root;
+}
+
+static void
+join_phase(int idx)
+{
+	struct peer *peer = &peers[idx];
+	struct peer **root = &peer->client->first[peer->phase];
+	peer->key = victim_key(&conns[idx]);
+	peer->child = peer->next = peer->prev = NULL;
+	*root = meld(*root, peer);
+}
+
+static void
+leave_phase(int idx)
+{
+	struct peer *peer = &peers[idx];
+	struct peer **root = &peer->client->first[peer->phase];
+	struct peer *rest = meld_pairs(peer->child);
+	if (peer == *root) {
+		*root = rest;
+		return;
+	}
+	if (peer->prev->child == peer) peer->prev->child = peer->next;
+	else peer->prev->next = peer->next;
+	if (peer->next) peer->next->prev = peer->prev;
+	*root = meld(*root, rest);
+}
+
+/* Files the connection where its progress now puts it. */
+static void
+rerank(int idx)
+{
+	struct peer *peer = &peers[idx];
+	if (!peer->client) return;
+	if (peer->phase == (int) conns[idx].phase && peer->key == victim_key(&conns[idx])) return;
+	leave_phase(idx);
+	if (peer->phase != (int) conns[idx].phase) {
+		peer->phase = conns[idx].phase;
+		peer->since = ++phase_entries;
+	}
+	join_phase(idx);
+}
+
+static void
+unhash_client(struct client *client)
+{
+	struct client **p = &client_table[client->hash & client_mask];
+	while (*p != client) p = &(*p)->next;
+	*p = client->next;
+}
+
+static void
+unidle_client(struct client *client)
+{
+	if (client->more) client->more->fewer = client->fewer;
+	else oldest_idle = client->fewer;
+	if (client->fewer) client->fewer->more = client->more;
+	else idle_clients = client->more;
+}
+
+static struct client *
+find_client(const struct sockaddr_storage *addr)
+{
+	unsigned hash = hash_addr(addr);
+	struct client *client = client_table[hash & client_mask];
+	while (client && !(client->hash == hash && same_addr(&client->addr, addr))) {
+		client = client->next;
+	}
+	return client;
+}
+
+static void
+attach_client(int idx)
+{
+	struct peer *peer = &peers[idx];
+	unsigned hash = hash_addr(&peer->addr);
+	struct client **head = &client_table[hash & client_mask];
+	struct client *client = find_client(&peer->addr);
+	if (client && !client->count) {
+		unidle_client(client);
+	} else if (!client) {
+		/* There are never more clients than connections, plus idle ones we can let go of. */
+		if ((client = free_clients)) {
+			free_clients = client->next;
+		} else {
+			client = oldest_idle;
+			unidle_client(client);
+			unhash_client(client);
+		}
+		memset(client, 0, sizeof *client);
+		client->addr = peer->addr;
+		client->hash = hash;
+		client->next = *head;
+		*head = client;
+	}
+	peer->client = client;
+	peer->phase = conns[idx].phase;
+	peer->since = ++phase_entries;
+	join_phase(idx);
+	count_client(client, 1);
+}
+
+static void
+detach_client(int idx)
+{
+	struct client *client = peers[idx].client;
+	if (!client) return;
+	leave_phase(idx);
+	peers[idx].client = NULL;
+	count_client(client, -1);
+	if (client->count) return;
+	/* Forgetting a client would hand it fresh buckets the moment it reconnects. */
+	uint64_t now = (client_reqs || client_bytes) ? now_us() : 0;
+	if (client->req_tat > now || client->byte_tat > now) {
+		client->fewer = NULL;
+		client->more = idle_clients;
+		if (client->more) client->more->fewer = client;
+		else oldest_idle = client;
+		idle_clients = client;
+		return;
+	}
+	unhash_client(client);
+	client->next = free_clients;
+	free_clients = client;
+}
+
+/* Whether -r, -b and -l apply. Unix socket peers are all one client, usually a reverse proxy
+ * speaking for everybody, so they are left alone. */
+static int
+limited(const struct client *client)
+{
+	return client->addr.ss_family != AF_UNIX;
+}
+
+/* The rates are kept as generic cell rate algorithm buckets: a client may run up to
+ * LIMIT_BURST seconds ahead of its schedule before it has to wait. */
+static int
+take_request(struct client *client)
+{
+	if (!client_reqs || !limited(client)) return 1;
+	uint64_t now = now_us(), tat = MAX(client->req_tat, now);
+	if (tat - now > (uint64_t) LIMIT_BURST * 1000000) return 0;
+	client->req_tat = tat + 1000000 / client_reqs;
+	return 1;
+}
+
+/* Bytes the client may be sent right now. */
+static size_t
+bytes_allowed(const struct client *client, uint64_t now)
+{
+	uint64_t full = now + (uint64_t) LIMIT_BURST * 1000000, tat = MAX(client->byte_tat, now);
+	return tat < full ? (full - tat) * client_bytes / 1000000 : 0;
+}
+
+/* Microseconds until the client may be sent another segment's worth, 0 if right away. */
+static uint64_t
+bytes_wait(const struct client *client, uint64_t now)
+{
+	uint64_t need = MIN(SMALL_RECORD, (uint64_t) client_bytes * LIMIT_BURST) * 1000000 / client_bytes;
+	uint64_t at = MAX(client->byte_tat, now) + need, full = now + (uint64_t) LIMIT_BURST * 1000000;
+	return at > full ? at - full : 0;
+}
+
+static void
+charge_bytes(struct client *client, size_t n, uint64_t now)
+{
+	client->byte_tat = MAX(client->byte_tat, now) + (uint64_t) n * 1000000 / client_bytes;
+}
+
+static int
+evict(void)
+{
+	/* The client with the most connections loses its least advanced one. */
+	struct client *client = by_count[max_count];
+	if (!client) return -1;
+	int phase = 0;
+	while (!client->first[phase]) phase++;
+	return client->first[phase] - peers;
+}
+
+static const struct status *
+status_of(int code)
+{
+	for (size_t i = 0; i < sizeof statuses / sizeof *statuses; i++) {
+		if (statuses[i].code == code) return &statuses[i];
+	}
+	return &statuses[0];
+}
+
+static void
+update_clock(void)
+{
+	time_t t = time(NULL);
+	if (t == cur_time) return;
+	cur_time = t;
+	format_date(cur_date, sizeof cur_date, t);
+	cur_date_len = strlen(cur_date);
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	strftime(log_date, sizeof log_date, "%d/%b/%Y:%H:%M:%S +0000", &tm);
+}
+
+static uint64_t
+now_ticks(void)
+{
+	return now_us() / 1000 / TIMER_TICK;
+}
+
+static void
+add_timer(struct timer *t)
+{
+	/* Anything overdue goes off on the next tick. */
+	if (t->at <= wheel_now) t->at = wheel_now + 1;
+	uint64_t delta = t->at - wheel_now;
+	int level = 0;
+	while (level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1))) level++;
+	if (delta >> (WHEEL_BITS * WHEEL_LEVELS)) t->at = wheel_now + ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	int slot = (t->at >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+	struct timer **head = &wheel[level][slot];
+	t->next  = *head;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = head;
+	*head    = t;
+	t->level = level;
+	t->slot  = slot;
+	wheel_bits[level] |= (uint64_t) 1 << slot;
+	ntimers++;
+}
+
+static void
+cancel_timer(struct timer *t)
+{
+	if (!t->pprev) return;
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	if (!wheel[t->level][t->slot]) wheel_bits[t->level] &= ~((uint64_t) 1 << t->slot);
+	t->pprev = NULL;
+	ntimers--;
+}
+
+/* (Re)starts the connection's one deadline, secs from now. */
+static void
+arm(int idx, int secs)
+{
+	struct timer *t = &conns[idx].timer;
+	cancel_timer(t);
+	t->at = now_ticks() + secs * 1000 / TIMER_TICK;
+	add_timer(t);
+}
+
+/* Ticks from wheel_now until run_timers() has something to do, or -1 for never. */
+static int
+next_timer(void)
+{
+	if (!ntimers) return -1;
+	int cur = wheel_now & (WHEEL_SLOTS - 1), k = (cur + 1) & (WHEEL_SLOTS - 1);
+	uint64_t bits = wheel_bits[0];
+	/* Rotate so that the slot after the current one is bit 0. */
+	if (k) bits = (bits >> k) | (bits << (WHEEL_SLOTS - k));
+	int ticks = bits ? __builtin_ctzll(bits) + 1 : WHEEL_SLOTS - cur;
+	/* Higher levels get cascaded down whenever level 0 wraps around. */
+	for (int l = 1; l < WHEEL_LEVELS; l++) {
+		if (wheel_bits[l]) return MIN(ticks, WHEEL_SLOTS - cur);
+	}
+	return ticks;
+}
+
+/* The path of the request being answered lives behind the headers in the scratch buffer. */
+static char *
+logged_path(const struct conn *conn)
+{
+	return conn->scratch + SCRATCH;
+}
+
+static int
+hist_bucket(uint64_t us)
+{
+	if (us < HIST_SUB) return us;
+	/* Keep the top bits: the power of two picks the row, the bits below it the bucket within. */
+	int shift = 63 - __builtin_clzll(us) - __builtin_ctz(HIST_SUB);
+	uint64_t i = (uint64_t) shift * HIST_SUB + (us >> shift);
+	return MIN(i, HIST_BUCKETS);
+}
+
+/* The largest value that still lands in bucket i. */
+static uint64_t
+hist_bound(int i)
+{
+	if (i < HIST_SUB) return i;
+	int shift = i / HIST_SUB - 1;
+	return ((uint64_t) (HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+static void
+observe(struct histogram *h, uint64_t us)
+{
+	h->counts[hist_bucket(us)]++;
+	h->count++;
+	h->sum += us;
+}
+
+static void
+flush_log(void)
+{
+	while (log_head != log_tail) {
+		unsigned from = log_tail & (LOG_RING - 1);
+		unsigned n = MIN(log_head - log_tail, LOG_RING - from);
+		ssize_t w = write(1, log_ring + from, n);
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) {
+			/* Nowhere to put it; better lose the log than stall. */
+			log_tail = log_head;
+			break;
+		}
+		log_tail += w;
+	}
+	log_flushed = cur_time;
+}
+
+static void
+log_request(int idx)
+{
+	const struct conn *conn = &conns[idx];
+	const struct sockaddr_storage *addr = &peers[idx].addr;
+	char host[INET6_ADDRSTRLEN] = "-";
+	if (addr->ss_family == AF_INET) {
+		inet_ntop(AF_INET, &((struct sockaddr_in *) addr)->sin_addr, host, sizeof host);
+	} else if (addr->ss_family == AF_INET6) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *) addr)->sin6_addr, host, sizeof host);
+	}
+
+	/* Clients choose the path, so keep them from forging lines or fields. */
+	char path[4 * MAX_PATH], *w = path;
+	for (const unsigned char *r = (const void *) logged_path(conn); *r; r++) {
+		if (*r < 0x20 || *r >= 0x7f || *r == '"' || *r == '\\') w += sprintf(w, "\\x%02x", *r);
+		else *w++ = *r;
+	}
+	*w = 0;
+
+	char line[LOG_LINE];
+	uint64_t us = now_us() - conn->started;
+	int n = snprintf(line, sizeof line, "%s - - [%s] \"GET %s HTTP/1.1\" %d %zu %llu.%06llu\n",
+		host, log_date, path, conn->status, conn->bytes,
+		(long long unsigned) us / 1000000, (long long unsigned) us % 1000000);
+	if (n >= 0 && LOG_RING - (log_head - log_tail) < (unsigned) n) flush_log();
+	if (n < 0 || n >= (int) sizeof line || LOG_RING - (log_head - log_tail) < (unsigned) n) {
+		log_dropped++;
+		return;
+	}
+	for (int i = 0; i < n; i++) log_ring[(log_head + i) & (LOG_RING - 1)] = line[i];
+	log_head += n;
+}
+
+/* Accounts for a finished (or aborted) response. */
+static void
+finish_request(int idx)
+{
+	const struct conn *conn = &conns[idx];
+	/* The request never got as far as having a status. */
+	if (!conn->status) return;
+	metrics.requests[status_of(conn->status) - statuses]++;
+	metrics.bytes += conn->bytes;
+	log_request(idx);
+}
+
+/* Writes out all of buf, unless fd stops taking it. */
+static void
+write_all(int fd, const char *buf, size_t len)
+{
+	for (size_t off = 0; off < len;) {
+		ssize_t n = write(fd, buf + off, len - off);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		off += n;
+	}
+}
+
+/* Writes all metrics in the Prometheus text format, to stderr or to the supervisor. */
+static void
+dump_metrics(void)
+{
+	static const char *phase_names[NUM_PHASES] = { "request", "response", "payload" };
+	char *text;
+	size_t len;
+	FILE *f = open_memstream(&text, &len);
+	if (!f) {
+		fprintf(stderr, "open_memstream: %s (non-fatal)\n", strerror(errno));
+		return;
+	}
+	int w = worker_id;
+
+	fprintf(f, "# TYPE brick_requests_total counter\n");
+	for (size_t i = 0; i < sizeof statuses / sizeof *statuses; i++) {
+		fprintf(f, "brick_requests_total{worker=\"%d\",code=\"%d\"} %lu\n",
+			w, statuses[i].code, metrics.requests[i]);
+	}
+	fprintf(f, "# TYPE brick_sent_bytes_total counter\n"
+		"brick_sent_bytes_total{worker=\"%d\"} %llu\n", w, metrics.bytes);
+	fprintf(f, "# TYPE brick_accepted_connections_total counter\n"
+		"brick_accepted_connections_total{worker=\"%d\"} %lu\n", w, metrics.accepted);
+	fprintf(f, "# TYPE brick_evicted_connections_total counter\n"
+		"brick_evicted_connections_total{worker=\"%d\"} %lu\n", w, metrics.evicted);
+	fprintf(f, "# TYPE brick_io_jobs_total counter\n"
+		"brick_io_jobs_total{worker=\"%d\",kind=\"resolve\"} %lu\n"
+		"brick_io_jobs_total{worker=\"%d\",kind=\"prefetch\"} %lu\n",
+		w, metrics.jobs[RESOLVE], w, metrics.jobs[PREFETCH]);
+	fprintf(f, "# TYPE brick_timeouts_total counter\n");
+	for (int p = 0; p < NUM_PHASES; p++) {
+		fprintf(f, "brick_timeouts_total{worker=\"%d\",phase=\"%s\"} %lu\n",
+			w, phase_names[p], metrics.timeouts[p]);
+	}
+	fprintf(f, "# TYPE brick_limited_total counter\n"
+		"brick_limited_total{worker=\"%d\",kind=\"requests\"} %lu\n"
+		"brick_limited_total{worker=\"%d\",kind=\"bytes\"} %lu\n"
+		"brick_limited_total{worker=\"%d\",kind=\"connections\"} %lu\n",
+		w, metrics.limited[REQUEST_LIMIT], w, metrics.limited[BYTE_LIMIT], w, metrics.limited[CONN_LIMIT]);
+	fprintf(f, "# TYPE brick_connections gauge\n"
+		"brick_connections{worker=\"%d\"} %d\n", w, nconns);
+	fprintf(f, "# TYPE brick_max_connections gauge\n"
+		"brick_max_connections{worker=\"%d\"} %d\n", w, max_conns);
+	fprintf(f, "# TYPE brick_cached_files gauge\n"
+		"brick_cached_files{worker=\"%d\"} %d\n", w, nfiles);
+	fprintf(f, "# TYPE brick_cached_response_bytes gauge\n"
+		"brick_cached_response_bytes{worker=\"%d\"} %zu\n", w, resp_bytes);
+	fprintf(f, "# TYPE brick_dropped_log_lines_total counter\n"
+		"brick_dropped_log_lines_total{worker=\"%d\"} %lu\n", w, log_dropped);
+#if BRICK_TLS
+	fprintf(f, "# TYPE brick_tls_handshakes_total counter\n"
+		"brick_tls_handshakes_total{worker=\"%d\",kind=\"full\"} %lu\n"
+		"brick_tls_handshakes_total{worker=\"%d\",kind=\"resumed\"} %lu\n",
+		w, full_handshakes, w, resumed_handshakes);
+#endif
+
+	fprintf(f, "# TYPE brick_phase_seconds histogram\n");
+	for (int p = 0; p < NUM_PHASES; p++) {
+		const struct histogram *h = &metrics.phases[p];
+		unsigned long total = 0;
+		for (int i = 0; i < HIST_BUCKETS; i++) {
+			total += h->counts[i];
+			fprintf(f, "brick_phase_seconds_bucket{worker=\"%d\",phase=\"%s\",le=\"%.6f\"} %lu\n",
+				w, phase_names[p], hist_bound(i) / 1e6, total);
+		}
+		fprintf(f, "brick_phase_seconds_bucket{worker=\"%d\",phase=\"%s\",le=\"+Inf\"} %lu\n"
+			"brick_phase_seconds_sum{worker=\"%d\",phase=\"%s\"} %.6f\n"
+			"brick_phase_seconds_count{worker=\"%d\",phase=\"%s\"} %lu\n",
+			w, phase_names[p], h->count, w, phase_names[p], h->sum / 1e6,
+			w, phase_names[p], h->count);
+	}
+
+	/* The supervisor reads up to the terminating NUL. */
+	if (fclose(f) == 0) write_all(metrics_fd, text, is_worker ? len + 1 : len);
+	free(text);
+}
+
+static char *
+get_buf(struct pool *pool)
+{
+	void *p = pool->free;
+	if (!p) return malloc(pool->size);
+	pool->free = *(void **) p;
+	pool->nfree--;
+	return p;
+}
+
+static void
+put_buf(struct pool *pool, char **buf)
+{
+	if (!*buf) return;
+	if (pool->nfree < POOL_KEEP) {
+		*(void **) *buf = pool->free;
+		pool->free = *buf;
+		pool->nfree++;
+	} else {
+		free(*buf);
+	}
+	*buf = NULL;
+}
+
+static void
+drain_pool(struct pool *pool)
+{
+	while (pool->free) {
+		void *p = pool->free;
+		pool->free = *(void **) p;
+		free(p);
+	}
+	pool->nfree = 0;
+}
+
+#if BRICK_URING
+/* Operations are told apart by their user_data: slot generation, what they are, and slot. */
+enum ring_op { RING_RECV, RING_SEND, RING_READ, RING_ACCEPT, RING_WAKE };
+#define RING_TAG(op, gen, idx) ((uint64_t) (gen) << 32 | (uint64_t) (op) << 24 | (uint64_t) (idx))
+#define RING_KEY(data) ((data) & ~((uint64_t) 0xff << 24))
+
+/* Hands the kernel what has been queued, and with wait, waits up to timeout milliseconds
+ * (-1 for ever) for something to complete. */
+static int
+ring_enter(int wait, int timeout)
+{
+	__atomic_store_n(sq_tail, sq_local, __ATOMIC_RELEASE);
+	unsigned pending = sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (!wait) {
+		if (!pending) return 0;
+		return syscall(SYS_io_uring_enter, ring_fd, pending, 0, 0, NULL, 0);
+	}
+	struct __kernel_timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = timeout % 1000 * 1000000L };
+	struct io_uring_getevents_arg arg = { .ts = timeout < 0 ? 0 : (uintptr_t) &ts };
+	return syscall(SYS_io_uring_enter, ring_fd, pending, 1,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof arg);
+}
+
+/* Whether n more submissions fit, after handing over the queue if need be. */
+static int
+ring_room(unsigned n)
+{
+	if (sq_entries - (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) >= n) return 1;
+	if (ring_enter(0, 0) < 0) {
+		fprintf(stderr, "io_uring_enter: %s (non-fatal)\n", strerror(errno));
+		return 0;
+	}
+	return sq_entries - (sq_local - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) >= n;
+}
+
+/* Queues a cleared submission; check ring_room() first. */
+static struct io_uring_sqe *
+get_sqe(void)
+{
+	struct io_uring_sqe *sqe = &sqes[sq_local++ & sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	return sqe;
+}
+
+static void
+prep_send(struct io_uring_sqe *sqe, int idx, const char *buf, size_t len, int flags)
+{
+	sqe->opcode    = IORING_OP_SEND;
+	sqe->fd        = conns[idx].sock;
+	sqe->addr      = (uintptr_t) buf;
+	sqe->len       = len;
+	sqe->msg_flags = flags;
+	sqe->user_data = RING_TAG(RING_SEND, conns[idx].gen, idx);
+}
+
+/* Gives a receive buffer back to the kernel. */
+static void
+recycle(int bid)
+{
+	unsigned short tail = recv_ring->tail;
+	struct io_uring_buf *b = &recv_ring->bufs[tail & (recv_count - 1)];
+	b->addr = (uintptr_t) (recv_bufs + (size_t) bid * SCRATCH);
+	b->len  = SCRATCH;
+	b->bid  = bid;
+	__atomic_store_n(&recv_ring->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+}
+
+/* Leaves the socket and buffers of a closed connection to its operations in flight.
+ * Shutting the socket down makes them finish soon; closing it could let a linked send
+ * pick up a descriptor that has been reused by then. */
+static void
+adopt(int idx)
+{
+	struct conn *conn = &conns[idx];
+	shutdown(conn->sock, SHUT_RDWR);
+	struct orphan *o = malloc(sizeof *o);
+	/* Without a record, they are leaked rather than pulled out from under the kernel. */
+	if (o) {
+		*o = (struct orphan) { orphans, RING_TAG(0, conn->gen, idx), conn->recving + conn->writing,
+			conn->sock, conn->scratch, conn->buf, conn->file, conn->shared };
+		orphans = o;
+	}
+	conn->scratch = conn->buf = NULL;
+	free(conn->ranges);
+}
+
+/* An operation of a connection that has been closed since is done. */
+static void
+bury(const struct io_uring_cqe *cqe)
+{
+	if (cqe->flags & IORING_CQE_F_BUFFER) recycle(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	for (struct orphan **p = &orphans; *p; p = &(*p)->next) {
+		struct orphan *o = *p;
+		if (o->key != RING_KEY(cqe->user_data)) continue;
+		if (--o->ops) return;
+		*p = o->next;
+		close(o->sock);
+		put_buf(&small_bufs, &o->scratch);
+		put_buf(&payload_bufs, &o->buf);
+		if (o->shared) o->file->sending--;
+		if (o->file) put_file(o->file);
+		free(o);
+		return;
+	}
+}
+#endif
+
+static void
+clr_conn(int idx)
+{
+	struct conn *conn = &conns[idx];
+#if BRICK_URING
+	if (conn->held) recycle(conn->held_bid);
+	if (conn->recving || conn->writing) {
+		adopt(idx);
+		return;
+	}
+#endif
+	close(conn->sock);
+	if (conn->shared) conn->file->sending--;
+	if (conn->file) put_file(conn->file);
+	free(conn->ranges);
+#if BRICK_TLS
+	tls_free(conn->tls);
+#endif
+}
+
+static void
+del_conn(int idx)
+{
+	debug("Closing a connection.\n");
+
+	int pos = conns[idx].pos;
+	/* Cut off in the middle of a response; log what it got. */
+	if (conns[idx].phase != REQUEST) finish_request(idx);
+	drop_job(idx);
+	cancel_timer(&conns[idx].timer);
+	detach_client(idx);
+	clr_conn(idx);
+	put_buf(&small_bufs, &conns[idx].in);
+	put_buf(&small_bufs, &conns[idx].scratch);
+	put_buf(&payload_bufs, &conns[idx].buf);
+
+	nconns--;
+	live[pos] = live[nconns];
+	conns[live[pos]].pos = pos;
+#if BRICK_POLL
+	conn_pfds[pos] = conn_pfds[nconns];
+#endif
+
+	uint32_t gen = conns[idx].gen + 1;
+	memset(&conns[idx], 0, sizeof (struct conn));
+	conns[idx].gen = gen;
+	conns[idx].pos = nconns;
+	live[nconns] = idx;
+}
+
+static void
+want(int idx, short events)
+{
+	conns[idx].events = events;
+#if BRICK_POLL
+	conn_pfds[conns[idx].pos].events = events;
+#endif
+}
+
+static int
+set_conn(int idx, int fd, const struct sockaddr_storage *addr, socklen_t addrlen, int use_tls)
+{
+	struct conn *conn = &conns[idx];
+
+#if BRICK_TLS
+	if (use_tls && tls_accept_socket(portal_tls, &conn->tls, fd) < 0) {
+		fprintf(stderr, "tls_accept: %s (non-fatal)\n", tls_error(portal_tls));
+		close(fd);
+		return -1;
+	}
+#else
+	(void) use_tls;
+#endif
+
+	memcpy(&peers[idx].addr, addr, addrlen);
+	conn->sock = fd;
+	/* The listener defers accept until data has arrived, so assume there is something to read. */
+	conn->ready = POLLIN | POLLOUT;
+
+#if BRICK_EPOLL
+	/* Edge-triggered, so we register for everything once and only track what we want in userspace. */
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+		.data.u64 = (uint64_t) conn->gen << 32 | idx };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		fprintf(stderr, "epoll_ctl: %s (non-fatal)\n", strerror(errno));
+		clr_conn(idx);
+		return -1;
+	}
+#elif BRICK_POLL
+	conn_pfds[conn->pos].fd      = fd;
+	conn_pfds[conn->pos].revents = 0;
+#endif
+	want(idx, POLLIN);
+	
+	return 0;
+}
+
+static int
+add_conn(int fd, struct sockaddr_storage *addr, socklen_t addrlen, int use_tls)
+{
+	debug("Accepted a new connection.\n");
+	metrics.accepted++;
+	if (nconns >= max_conns) {
+		metrics.evicted++;
+		del_conn(evict());
+	}
+	int idx = live[nconns];
+	if (set_conn(idx, fd, addr, addrlen, use_tls) < 0) return -1;
+	attach_client(idx);
+	arm(idx, REQUEST_TIMEOUT);
+	nconns++;
+	return idx;
+}
+
+#if BRICK_TLS
+static int
+secure_read(int idx)
+{
+	struct conn *conn = &conns[idx];
+	ssize_t n = tls_read(conn->tls, conn->in + conn->in_len, SCRATCH - conn->in_len);
+	switch (n) {
+	case -1: fprintf(stderr, "tls_read: %s (non-fatal)\n", tls_error(conn->tls)); return -1;
+	case 0:  return -1;
+	case TLS_WANT_POLLIN:  conn->ready &= ~POLLIN;  want(idx, POLLIN);  break;
+	case TLS_WANT_POLLOUT: conn->ready &= ~POLLOUT; want(idx, POLLOUT); break;
+	default:
+		if (!conn->handshaken) {
+			conn->handshaken = 1;
+			if (tls_conn_session_resumed(conn->tls)) resumed_handshakes++;
+			else full_handshakes++;
+		}
+		if (!conn->in_len) conn->started = now_us();
+		conn->in_len += n;
+	}
+	/* Idle keep-alive connections should not hold on to a buffer. */
+	if (!conn->in_len) put_buf(&small_bufs, &conn->in);
+	return 0;
+}
+
+static int
+secure_write(int idx)
+{
+	struct conn *conn = &conns[idx];
+	ssize_t n = tls_write(conn->tls, conn->out + conn->offset, MIN(conn->length - conn->offset, send_budget));
+	switch (n) {
+	case -1: fprintf(stderr, "tls_write: %s (non-fatal)\n", tls_error(conn->tls)); return -1;
+	case TLS_WANT_POLLIN:  conn->ready &= ~POLLIN;  want(idx, POLLIN);  break;
+	case TLS_WANT_POLLOUT: conn->ready &= ~POLLOUT; want(idx, POLLOUT); break;
+	default:
+		conn->offset += n;
+		conn->bytes += n;
+	}
+	return 0;
+}
+#endif
+
+/* Whether the connection came in on a TLS portal. */
+static int
+secure(const struct conn *conn)
+{
+#if BRICK_TLS
+	return conn->tls != NULL;
+#else
+	(void) conn;
+	return 0;
+#endif
+}
+
+#if BRICK_URING
+/* Takes in what the last receive brought. Once it is all in, the next bytes come with the next receive. */
+static void
+take_held(int idx)
+{
+	struct conn *conn = &conns[idx];
+	size_t n = MIN(conn->held_len, SCRATCH - conn->in_len);
+	memcpy(conn->in + conn->in_len, conn->held, n);
+	if (!conn->in_len) conn->started = now_us();
+	conn->in_len += n;
+	conn->held += n;
+	conn->held_len -= n;
+	if (!conn->held_len) {
+		recycle(conn->held_bid);
+		conn->held = NULL;
+		conn->ready &= ~POLLIN;
+	}
+}
+#endif
+
+static int
+conn_read(int idx)
+{
+	struct conn *conn = &conns[idx];
+	if (conn->in_len == SCRATCH) return -1;
+	if (!conn->in && !(conn->in = get_buf(&small_bufs))) return -1;
+#if BRICK_TLS
+	if (secure(conn)) return secure_read(idx);
+#endif
+#if BRICK_URING
+	/* Without anything held, this is the first request or the receive ran out of buffers; read() it is. */
+	if (conn->held) {
+		take_held(idx);
+		return 0;
+	}
+#endif
+	for (;;) {
+		ssize_t n = read(conn->sock, conn->in + conn->in_len, SCRATCH - conn->in_len);
+		if (!n) return -1;
+		if (n > 0) {
+			if (!conn->in_len) conn->started = now_us();
+			conn->in_len += n;
+			return 0;
+		}
+		switch (errno) {
+		case EINTR: continue;
+#if EAGAIN != EWOULDBLOCK
+		case EAGAIN:
+#endif
+		case EWOULDBLOCK:
+			conn->ready &= ~POLLIN;
+			/* Idle keep-alive connections should not hold on to a buffer. */
+			if (!conn->in_len) put_buf(&small_bufs, &conn->in);
+			return 0;
+		default: return -1;
+		}
+	}
+}
+
+static int
+conn_write(int idx)
+{
+	struct conn *conn = &conns[idx];
+#if BRICK_TLS
+	if (secure(conn)) return secure_write(idx);
+#endif
+	/* With payload still to come, let the kernel hold a partial segment back for it,
+	 * so the head and the start of the payload go out together. */
+	int flags = conn->content_length ? MSG_MORE : 0;
+#if BRICK_URING
+	if (!ring_room(1)) return -1;
+	prep_send(get_sqe(), idx, conn->out + conn->offset, MIN(conn->length - conn->offset, send_budget), flags);
+	conn->corked = flags != 0;
+	conn->writing = 1;
+	/* The send completes later; until then, there is nothing more to do for POLLOUT. */
+	conn->ready &= ~POLLOUT;
+	return 0;
+#else
+	for (;;) {
+		ssize_t n = send(conn->sock, conn->out + conn->offset, MIN(conn->length - conn->offset, send_budget), flags);
+		if (n >= 0) {
+			conn->corked = flags != 0;
+			conn->offset += n;
+			conn->bytes += n;
+			return 0;
+		}
+		switch (errno) {
+		case EINTR: continue;
+#if EAGAIN != EWOULDBLOCK
+		case EAGAIN:
+#endif
+		case EWOULDBLOCK: conn->ready &= ~POLLOUT; return 0;
+		default: return -1;
+		}
+	}
+#endif
+}
+
+/* Sends off what MSG_MORE left waiting, for when the rest is not going to follow right away. */
+static void
+uncork(int idx)
+{
+	struct conn *conn = &conns[idx];
+	if (!conn->corked) return;
+	conn->corked = 0;
+	/* Turning on TCP_NODELAY pushes out anything pending; Nagle goes back on for what comes after. */
+	int on = 1, off = 0;
+	setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &off, sizeof off);
+}
+
+#if BRICK_SENDFILE
+static int
+conn_sendfile(int idx)
+{
+	struct conn *conn = &conns[idx];
+	size_t len = MIN(MIN(conn->content_length, SEND_CHUNK), send_budget);
+	if (io_threads) len = MIN(len, (size_t) (conn->warm_to - conn->src_off));
+	for (;;) {
+		ssize_t n = sendfile(conn->sock, conn->file->fd, &conn->src_off, len);
+		/* The file shrank underneath us. */
+		if (!n) return -1;
+		if (n > 0) {
+			conn->corked = 0;
+			conn->content_length -= n;
+			conn->bytes += n;
+			return 0;
+		}
+		switch (errno) {
+		case EINTR: continue;
+#if EAGAIN != EWOULDBLOCK
+		case EAGAIN:
+#endif
+		case EWOULDBLOCK: conn->ready &= ~POLLOUT; return 0;
+		/* Not every kind of file supports sendfile(). */
+		case EINVAL:
+		case ENOSYS: conn->buffered = 1; return 0;
+		default: return -1;
+		}
+	}
+}
+#endif
+
+static size_t
+chunk_size(const struct conn *conn)
+{
+	/* Start out with records that fit into one segment, so the client can decrypt
+	 * as soon as the first packets arrive. Once the window has opened up, use full records. */
+	if (secure(conn) && conn->sent < RECORD_RAMP) return SMALL_RECORD;
+	return PAYLOAD_BUF;
+}
+
+static void
+switch_phase(int idx, enum phase phase)
+{
+	struct conn *conn = &conns[idx];
+	if (phase != conn->phase) {
+		uint64_t now = now_us();
+		/* Waiting for a request only counts once the request has begun to arrive. */
+		uint64_t since = conn->phase == REQUEST ? conn->started : conn->phase_at;
+		observe(&metrics.phases[conn->phase], now - since);
+		conn->phase_at = now;
+		/* Back to waiting for a request means a response is complete. */
+		if (phase == REQUEST) {
+			finish_request(idx);
+			/* A pipelined request has been there all along. */
+			if (conn->in_len) conn->started = now;
+			arm(idx, conn->in_len ? REQUEST_TIMEOUT : IDLE_TIMEOUT);
+		}
+		if (phase == RESPONSE) {
+			conn->window_from = 0;
+			arm(idx, SEND_WINDOW);
+		}
+	}
+	conn->phase  = phase;
+	conn->offset = 0;
+	conn->length = 0;
+	rerank(idx);
+	want(idx, phase == REQUEST ? POLLIN : POLLOUT);
+	if (phase == REQUEST) {
+		put_buf(&small_bufs, &conn->scratch);
+		put_buf(&payload_bufs, &conn->buf);
+		drop_job(idx);
+		conn->warm_from = 0;
+		conn->warm_to = 0;
+		/* A pipelined request may already be waiting, and no new readiness will announce it. */
+		if (conn->in_len) conn->ready |= POLLIN;
+	}
+}
+
+/* Finds the first a or b in [p, end), or returns end. */
+static char *
+find2(char *p, const char *end, char a, char b)
+{
+#if defined(__AVX2__)
+	__m256i a32 = _mm256_set1_epi8(a), b32 = _mm256_set1_epi8(b);
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const void *) p);
+		unsigned m = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, a32), _mm256_cmpeq_epi8(v, b32)));
+		if (m) return p + __builtin_ctz(m);
+	}
+#endif
+#if defined(__SSE2__)
+	__m128i a16 = _mm_set1_epi8(a), b16 = _mm_set1_epi8(b);
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const void *) p);
+		unsigned m = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, a16), _mm_cmpeq_epi8(v, b16)));
+		if (m) return p + __builtin_ctz(m);
+	}
+#endif
+	while (p < end && *p != a && *p != b) p++;
+	return p;
+}
+
+/* FNV-1a, ignoring ASCII case. Good enough to tell our few header names apart. */
+static unsigned
+hash_name(const char *name, size_t len)
+{
+	unsigned h = 2166136261u;
+	for (size_t i = 0; i < len; i++) h = (h ^ (name[i] | 0x20)) * 16777619u;
+	return h;
+}
+
+static void
+init_key_slots(void)
+{
+	for (int k = 0; k < NUM_HEADERS; k++) {
+		unsigned h = hash_name(req_keys[k], strlen(req_keys[k]));
+		while (key_slots[h & (HEADER_SLOTS - 1)]) h++;
+		key_slots[h & (HEADER_SLOTS - 1)] = k + 1;
+	}
+}
+
+static int
+find_key(const char *name, size_t len)
+{
+	unsigned h = hash_name(name, len);
+	for (int k; (k = key_slots[h & (HEADER_SLOTS - 1)]); h++) {
+		k--;
+		if (strlen(req_keys[k]) == len && !strncasecmp(name, req_keys[k], len)) return k;
+	}
+	return -1;
+}
+
+/* Parses the request head in buf[0..len), which ends with the CRLF of its last line.
+ * Nothing is copied; the path and recognized header values are recorded in req. */
+static int
+parse_http(char *buf, size_t len)
+{
+	char *p = buf, *q, *end = buf + len;
+
+	memset(&req, 0, sizeof req);
+	req.buf = buf;
+
+	/* Ensure the used method is GET. */
+	if (len < 4 || memcmp(p, "GET ", 4)) return -1;
+	p += 4;
+
+	/* Parse the target path. */
+	q = find2(p, end, ' ', '\r');
+	if (q == end || *q != ' ' || p == q) return -1;
+	req.path = (struct view) { p - buf, q - p };
+	p = q + 1;
+
+	/* Parse the HTTP version & end of line. */
+	if (end - p < 10 || memcmp(p, "HTTP/1.1\r\n", 10)) return -1;
+	p += 10;
+
+	/* Assume each line corresponds to a header field. */
+	while (p < end) {
+		q = find2(p, end, ':', '\r');
+		if (q == end) return -1;
+		/* If we don't recognize the header field, we silently ignore it. */
+		int k = *q == ':' ? find_key(p, q - p) : -1;
+		if (k >= 0) {
+			/* Skip whitespace after the colon. */
+			for (p = q + 1; *p == ' ' || *p == '\t'; p++);
+		}
+
+		q = find2(p, end, '\r', '\r');
+		if (end - q < 2 || q[1] != '\n') return -1;
+		if (k >= 0) {
+			/* A repeated field wins over the earlier one, whose line end goes back in. */
+			if (req.headers[k].off) buf[req.headers[k].off + req.headers[k].len] = '\r';
+			req.headers[k] = (struct view) { p - buf, q - p };
+			*q = 0;
+		}
+		p = q + 2;
+	}
+	return 0;
+}
+
+/* Puts back the line ends parse_http() overwrote, so that the request can be parsed again. */
+static void
+unparse_http(char *buf)
+{
+	for (int k = 0; k < NUM_HEADERS; k++) {
+		if (req.headers[k].off) buf[req.headers[k].off + req.headers[k].len] = '\r';
+	}
+}
+
+/* The value of a recognized header, or "" if the request didn't have it. */
+static const char *
+req_header(int key)
+{
+	return req.headers[key].off ? req.buf + req.headers[key].off : "";
+}
+/* Tells whether a qvalue is zero, meaning "not acceptable". */
+static int
+zero_qvalue(const char *q)
+{
+	if (*q++ != '0') return 0;
+	if (*q++ != '.') return 1;
+	while (*q == '0') q++;
+	return !(*q >= '1' && *q <= '9');
+}
+
+/* Parses an Accept-Encoding value into a bit mask of acceptable codings. */
+static unsigned
+accepted_codings(const char *value)
+{
+	unsigned accepted = 0, listed = 0;
+	int star = 0;
+	const char *p = value;
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		const char *tok = p;
+		while (*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+		size_t len = p - tok;
+		int zero = 0;
+		while (*p && *p != ',') {
+			if ((*p == 'q' || *p == 'Q') && p[1] == '=') zero = zero_qvalue(p + 2);
+			p++;
+		}
+		if (len == 1 && *tok == '*') {
+			star = !zero;
+			continue;
+		}
+		for (int c = 1; c < NUM_CODINGS; c++) {
+			if (strlen(codings[c].name) != len || strncasecmp(tok, codings[c].name, len)) continue;
+			listed |= 1 << c;
+			if (!zero) accepted |= 1 << c;
+		}
+	}
+	if (star) accepted |= ~listed;
+	return accepted;
+}
+
+static int
+parse_offset(const char **p, off_t *off)
+{
+	const off_t max = (off_t) (((uintmax_t) 1 << (sizeof (off_t) * 8 - 1)) - 1);
+	if (!(**p >= '0' && **p <= '9')) return -1;
+	off_t v = 0;
+	for (; **p >= '0' && **p <= '9'; ++*p) {
+		if (v > (max - 9) / 10) return -1;
+		v = v * 10 + (**p - '0');
+	}
+	*off = v;
+	return 0;
+}
+
+/* Parses a Range value for a file of the given size.
+ * Returns how many ranges are satisfiable, or -1 if the header should be ignored. */
+static int
+parse_ranges(const char *value, off_t size, struct range *ranges)
+{
+	const char *p = value;
+	int n = 0, seen = 0;
+	if (strncmp(p, "bytes=", 6)) return -1;
+	p += 6;
+	for (;;) {
+		while (*p == ' ' || *p == '\t') p++;
+		off_t first, last = size - 1;
+		if (*p == '-') {
+			/* Suffix range: the last n bytes. */
+			p++;
+			if (parse_offset(&p, &first) < 0) return -1;
+			first = first < size ? size - first : 0;
+		} else {
+			if (parse_offset(&p, &first) < 0 || *p++ != '-') return -1;
+			if (*p >= '0' && *p <= '9') {
+				if (parse_offset(&p, &last) < 0 || last < first) return -1;
+				if (last >= size) last = size - 1;
+			}
+		}
+		/* Too many ranges are more likely an attack than a real client. */
+		if (++seen > MAX_RANGES) return -1;
+		if (first <= last) {
+			ranges[n].first = first;
+			ranges[n].last  = last;
+			n++;
+		}
+		while (*p == ' ' || *p == '\t') p++;
+		if (!*p) return n;
+		if (*p++ != ',') return -1;
+	}
+}
+
+static int
+sanitize_path(char *path)
+{
+	char *r = path, *w = path;
+	/* Paths must start with a slash. */
+	if (*r != '/') return -1;
+	/* Go through the path step-by-step. */
+	for (;;) {
+		/* Invariant: the path contained a slash right before the current character. */
+		/* Remove duplicate slashes, they are confusing. */
+		while (*r == '/') r++;
+		/* Refuse to access any file or directory that starts with a dot. Especially '../'! */
 		if (*r == '.') return -1;
 		/* Find the next delimiting slash */
 		char *d = strchr(r, '/');
@@ -383,218 +2308,1597 @@ sanitize_path(char *path)
 		w += l;
 		r = d;
 	}
-	size_t l = strlen(r);
-	if (l) {
-		/* Copy end of path over verbatim & NUL terminate. */
-		memmove(w, r, l);
-		w[l] = 0;
+	size_t l = strlen(r);
+	if (l) {
+		/* Copy end of path over verbatim & NUL terminate. */
+		memmove(w, r, l);
+		w[l] = 0;
+	} else {
+		/* Path ends on a slash, so we append index.html if we can. */
+		/* Note: sizeof (string literal) == strlen + 1 */
+		if (w + sizeof "index.html" > path + MAX_PATH) return -1;
+		strcpy(w, "index.html");
+	}
+	return 0;
+}
+
+/* Returns the status code, -1 for a broken request, or 0 if an I/O thread has to open the file first. */
+static int
+load_content(int idx, size_t len, const char **mime)
+{
+	struct conn *conn = &conns[idx];
+	conn->content_length = 0;
+	*mime = "text/plain";
+
+	if (parse_http(conn->in, len) < 0) return -1;
+	size_t n = MIN(req.path.len, MAX_PATH - 1);
+	memcpy(req_path, req.buf + req.path.off, n);
+	req_path[n] = 0;
+	memcpy(logged_path(conn), req_path, n + 1);
+	debug("Requested path: %s\n", req_path);
+
+	/* Coming back from a job, the request has already been paid for. */
+	if (!conn->resolves && !take_request(peers[idx].client)) {
+		metrics.limited[REQUEST_LIMIT]++;
+		return 429;
+	}
+
+	if (sanitize_path(req_path) < 0) return 400;
+	debug("Sanitized path: %s\n", req_path);
+
+	struct file *file = get_file(idx, req_path, 0);
+	if (!file) return errno == EINPROGRESS ? 0 : 404;
+
+	check_sidecars(file);
+	unsigned accepted = file->sides ? accepted_codings(req_header(ACCEPT_ENCODING)) : 0;
+	for (int c = 1; c < NUM_CODINGS; c++) {
+		if (!(file->sides & accepted & (1u << c))) continue;
+		char path[MAX_PATH];
+		snprintf(path, sizeof path, "%s%s", req_path, codings[c].suffix);
+		struct file *side = get_file(idx, path, c);
+		if (!side && errno == EINPROGRESS) {
+			put_file(file);
+			return 0;
+		}
+		if (!side) continue;
+		put_file(file);
+		file = side;
+		break;
+	}
+
+	conn->file = file;
+	conn->src_off = 0;
+	conn->content_length = file->size;
+	*mime = file->mime;
+
+	return 200;
+}
+
+static char *
+append(char *p, const char *s, size_t n)
+{
+	memcpy(p, s, n);
+	return p + n;
+}
+
+static char *
+append_number(char *p, unsigned long long v)
+{
+	char digits[20];
+	int n = 0;
+	do digits[n++] = '0' + v % 10; while (v /= 10);
+	while (n) *p++ = digits[--n];
+	return p;
+}
+
+/* Writes the status line, Server and Date into buf, which must hold SCRATCH bytes. */
+static char *
+start_head(char *buf, int code)
+{
+	const struct status *st = status_of(code);
+	char *p = append(buf, st->head, st->head_len);
+	return append(p, cur_date, cur_date_len);
+}
+
+static size_t
+format_head(char *buf, int code, const char *mime, const char *extra, size_t length)
+{
+	char *p = start_head(buf, code);
+	p = append(p, "\r\nContent-Type: ", 16);
+	p = append(p, mime, strlen(mime));
+	p = append(p, "\r\n", 2);
+	if (code == 200 || code == 206) p = append(p, "Accept-Ranges: bytes\r\n", 22);
+	p = append(p, extra, strlen(extra));
+	p = append(p, "Content-Length: ", 16);
+	p = append_number(p, length);
+	p = append(p, "\r\n\r\n", 4);
+	return p - buf;
+}
+
+/* The whole head of a 200 response for file, put together from its precomputed parts. */
+static size_t
+format_file_head(char *buf, const struct file *file)
+{
+	char *p = start_head(buf, 200);
+	p = append(p, file->head, file->head_len);
+	return p - buf;
+}
+
+static size_t
+format_part(char *buf, size_t size, const struct file *file, const struct range *r)
+{
+	return snprintf(buf, size,
+		"\r\n--%s\r\n"
+		"Content-Type: %s\r\n"
+		"Content-Range: bytes %llu-%llu/%llu\r\n"
+		"\r\n",
+		boundary, file->mime, (long long unsigned) r->first,
+		(long long unsigned) r->last, (long long unsigned) file->size);
+}
+
+static size_t
+format_trailer(char *buf, size_t size)
+{
+	return snprintf(buf, size, "\r\n--%s--\r\n", boundary);
+}
+
+/* If-Range makes the Range header conditional on the file being unchanged. */
+static int
+range_applies(const struct file *file)
+{
+	const char *v = req_header(IF_RANGE);
+	if (!*v) return 1;
+	/* An entity tag has to match strongly, so weak ones never do. */
+	if (*v == '"') return !strcmp(v, file->etag);
+	return !strcmp(v, file->modified);
+}
+
+/* Weak comparison of our entity tag against an If-None-Match list. */
+static int
+etag_listed(const char *list, const char *etag)
+{
+	size_t len = strlen(etag);
+	const char *p = list;
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == ',') p++;
+		if (*p == '*') return 1;
+		if (!strncmp(p, "W/", 2)) p += 2;
+		if (!strncmp(p, etag, len) && (!p[len] || strchr(", \t", p[len]))) return 1;
+		while (*p && *p != ',') p++;
+	}
+	return 0;
+}
+
+static int
+not_modified(const struct file *file)
+{
+	/* If-None-Match takes precedence, If-Modified-Since is only a fallback. */
+	if (req_header(IF_NONE_MATCH)[0]) return etag_listed(req_header(IF_NONE_MATCH), file->etag);
+	if (!req_header(IF_MODIFIED_SINCE)[0]) return 0;
+	struct tm tm = { 0 };
+	const char *end = strptime(req_header(IF_MODIFIED_SINCE), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	if (!end || *end) return 0;
+	return file->mtime.tv_sec <= timegm(&tm);
+}
+
+/* Sets the connection up for a 206 or 416 response. Returns the status code. */
+static int
+prepare_ranges(int idx, char *extra, size_t size)
+{
+	struct conn *conn = &conns[idx];
+	struct file *file = conn->file;
+	struct range ranges[MAX_RANGES];
+	int n = parse_ranges(req_header(RANGE), file->size, ranges);
+	if (n < 0) return 200;
+
+	if (!n) {
+		snprintf(extra, size, "Content-Range: bytes */%llu\r\n", (long long unsigned) file->size);
+		return 416;
+	}
+
+	if (n == 1) {
+		snprintf(extra, size, "Content-Range: bytes %llu-%llu/%llu\r\n%s",
+			(long long unsigned) ranges[0].first, (long long unsigned) ranges[0].last,
+			(long long unsigned) file->size, file->headers);
+		conn->src_off = ranges[0].first;
+		conn->content_length = ranges[0].last - ranges[0].first + 1;
+		return 206;
+	}
+
+	if (!(conn->ranges = malloc(n * sizeof *ranges))) return 200;
+	memcpy(conn->ranges, ranges, n * sizeof *ranges);
+	conn->nranges = n;
+	conn->range = 0;
+	/* The framing counts towards Content-Length, so measure it up front. */
+	char part[SCRATCH];
+	size_t total = format_trailer(part, sizeof part);
+	for (int i = 0; i < n; i++) {
+		total += format_part(part, sizeof part, file, &ranges[i]);
+		total += ranges[i].last - ranges[i].first + 1;
+	}
+	snprintf(extra, size, "%s", file->headers);
+	conn->content_length = total;
+	return 206;
+}
+
+/* Frees the oldest cached responses until we are within budget again. */
+static void
+trim_responses(void)
+{
+	for (struct file *file = oldest_file; file && resp_bytes > RESP_CACHE; file = file->newer) {
+		if (file->resp && !file->sending) drop_response(file);
+	}
+}
+
+/* Makes sure file->resp holds an up-to-date response. Returns 0 if it can't be cached. */
+static int
+cache_response(struct file *file)
+{
+	if (file->resp) {
+		/* Connections still writing it out would see a torn date, so a slightly stale one has to do. */
+		if (file->dated != cur_time && !file->sending) {
+			memcpy(file->resp + file->date_at, cur_date, cur_date_len);
+			file->dated = cur_time;
+		}
+		return 1;
+	}
+
+	char head[SCRATCH];
+	size_t len = format_file_head(head, file);
+	char *resp = malloc(len + file->size);
+	if (!resp) return 0;
+	memcpy(resp, head, len);
+	/* If it isn't in the page cache, let the payload path deal with the disk this time. */
+	if (pread_nowait(file->fd, resp + len, file->size, 0) != file->size) {
+		free(resp);
+		return 0;
+	}
+	file->resp     = resp;
+	file->resp_len = len + file->size;
+	file->date_at  = status_of(200)->head_len;
+	file->dated    = cur_time;
+	resp_bytes += file->resp_len;
+	trim_responses();
+	return file->resp != NULL;
+}
+
+/* Returns 1 if the request has to wait for an I/O thread, and is to be processed again after. */
+static int
+process_request(int idx, size_t len)
+{
+	struct conn *conn = &conns[idx];
+	if (!conn->scratch && !(conn->scratch = get_buf(&small_bufs))) return -1;
+
+	const char *mime;
+	int code = load_content(idx, len, &mime);
+	if (code < 0) return -1;
+	if (!code) return 1;
+	/* Somebody else may have opened the file in the meantime; then the result is of no use. */
+	drop_job(idx);
+	conn->resolves = 0;
+	switch_phase(idx, RESPONSE);
+
+	struct file *file = conn->file;
+	char extra[MAX_HEADER + 300] = "";
+	if (code == 200 && not_modified(file)) {
+		/* Only headers, the client already has the body. */
+		char *p = start_head(conn->scratch, 304);
+		p = append(p, "\r\n", 2);
+		p = append(p, file->headers, strlen(file->headers));
+		p = append(p, "\r\n", 2);
+		conn->out = conn->scratch;
+		conn->length = p - conn->scratch;
+		conn->content_length = 0;
+		conn->status = 304;
+		return 0;
+	}
+	if (code == 200 && req_header(RANGE)[0] && range_applies(file)) {
+		code = prepare_ranges(idx, extra, sizeof extra);
+	}
+	if (code == 429) strcpy(extra, "Retry-After: 1\r\n");
+	conn->status = code;
+
+	if (code == 200 && file->size <= SMALL_FILE && cache_response(file)) {
+		/* Everything goes out in a single write straight from the cache. */
+		conn->out = file->resp;
+		conn->length = file->resp_len;
+		conn->content_length = 0;
+		conn->shared = 1;
+		file->sending++;
+		return 0;
+	}
+
+	conn->out = conn->scratch;
+	if (code == 200) {
+		conn->length = format_file_head(conn->scratch, file);
+	} else if (code == 206) {
+		conn->length = format_head(conn->scratch, code, conn->ranges ? multipart_type : mime,
+			extra, conn->content_length);
 	} else {
-		/* Path ends on a slash, so we append index.html if we can. */
-		/* Note: sizeof (string literal) == strlen + 1 */
-		if (w + sizeof "index.html" > path + MAX_PATH) return -1;
-		strcpy(w, "index.html");
+		const char *msg = status_of(code)->name;
+		conn->content_length = 0;
+		conn->length = format_head(conn->scratch, code, "text/plain", extra, 4 + strlen(msg));
+		conn->length += snprintf(conn->scratch + conn->length, SCRATCH - conn->length,
+			"%03d %s", code, msg);
+	}
+
+	return 0;
+}
+
+static void
+end_payload(int idx)
+{
+	struct conn *conn = &conns[idx];
+	debug("Sent the payload.\n");
+	switch_phase(idx, REQUEST);
+	put_file(conn->file);
+	conn->file = NULL;
+	free(conn->ranges);
+	conn->ranges = NULL;
+	conn->buffered = 0;
+	conn->sent = 0;
+}
+
+/* Moves on to the next part of a multipart/byteranges payload, or finishes the payload. */
+static void
+next_part(int idx)
+{
+	struct conn *conn = &conns[idx];
+	if (!conn->ranges || conn->range > conn->nranges) {
+		end_payload(idx);
+		return;
+	}
+	conn->out = conn->scratch;
+	conn->offset = 0;
+	if (conn->range == conn->nranges) {
+		conn->length = format_trailer(conn->scratch, SCRATCH);
+	} else {
+		struct range *r = &conn->ranges[conn->range];
+		conn->length = format_part(conn->scratch, SCRATCH, conn->file, r);
+		conn->src_off = r->first;
+		conn->content_length = r->last - r->first + 1;
+	}
+	conn->range++;
+}
+
+#if !BRICK_URING
+static int
+start_prefetch(int idx, off_t off)
+{
+	struct conn *conn = &conns[idx];
+	struct job *job = calloc(1, sizeof *job);
+	if (!job) return -1;
+	job->kind = PREFETCH;
+	job->file = conn->file;
+	job->file->refs++;
+	job->off  = off;
+	job->len  = MIN(READ_AHEAD, conn->src_off + (off_t) conn->content_length - off);
+	submit(idx, job);
+	return 0;
+}
+
+/* Whether the payload at src_off has been read ahead. While it has, the next stretch is kept coming. */
+static int
+payload_warm(int idx)
+{
+	struct conn *conn = &conns[idx];
+	if (!io_threads) return 1;
+	if (conn->src_off < conn->warm_from || conn->src_off >= conn->warm_to) return 0;
+	off_t end = conn->src_off + conn->content_length;
+	if (!conn->job && conn->warm_to < end && conn->warm_to - conn->src_off < READ_AHEAD / 2) {
+		start_prefetch(idx, conn->warm_to);
+	}
+	return 1;
+}
+
+/* Parks the connection until an I/O thread has read ahead from src_off. */
+static int
+prefetch(int idx)
+{
+	struct conn *conn = &conns[idx];
+	if (!conn->job && start_prefetch(idx, conn->src_off) < 0) return -1;
+	uncork(idx);
+	conn->parked = 1;
+	want(idx, 0);
+	return 0;
+}
+#else
+/* Reads the next stretch of payload into buf and sends it on. The two are linked, so the kernel
+ * goes from one to the other by itself, and the disk never holds up the event loop.
+ * A short read cancels the send; what was read then goes out through conn_write(). */
+static int
+ring_payload(int idx)
+{
+	struct conn *conn = &conns[idx];
+	size_t len = MIN(MIN(chunk_size(conn), conn->content_length), send_budget);
+	if (!ring_room(2)) return -1;
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode    = IORING_OP_READ;
+	sqe->fd        = conn->file->fd;
+	sqe->addr      = (uintptr_t) conn->buf;
+	sqe->len       = len;
+	sqe->off       = conn->src_off;
+	sqe->flags     = IOSQE_IO_LINK;
+	sqe->user_data = RING_TAG(RING_READ, conn->gen, idx);
+	int flags = conn->content_length > len ? MSG_MORE : 0;
+	prep_send(get_sqe(), idx, conn->buf, len, flags);
+	conn->corked = flags != 0;
+	conn->length = 0;
+	conn->writing = 2;
+	conn->ready &= ~POLLOUT;
+	return 0;
+}
+#endif
+
+static char *
+header_end(const struct conn *conn)
+{
+	if (!conn->in_len) return NULL;
+	return memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+}
+
+static int
+process_conn(int idx)
+{
+	struct conn *conn = &conns[idx];
+	switch (conn->phase) {
+	case REQUEST: {
+		char *end = header_end(conn);
+		if (!end) {
+			size_t had = conn->in_len;
+			if (conn_read(idx) < 0) return -1;
+			/* From the first byte on, the idle timeout no longer applies, but the request timeout does. */
+			if (!had && conn->in_len) arm(idx, REQUEST_TIMEOUT);
+			if (!(end = header_end(conn))) return 0;
+		}
+
+		debug("Received a request.\n");
+		conn->bytes = 0;
+		conn->status = 0;
+		int ret = process_request(idx, end + 2 - conn->in);
+		if (ret < 0) return -1;
+		/* Parked until the file is open; then we come back here and parse it all over again. */
+		if (ret > 0) {
+			unparse_http(conn->in);
+			conn->parked = 1;
+			want(idx, 0);
+			return 0;
+		}
+		/* The request has been parsed; keep whatever the client sent after it. */
+		size_t used = end + 4 - conn->in;
+		memmove(conn->in, conn->in + used, conn->in_len - used);
+		conn->in_len -= used;
+		if (!conn->in_len) put_buf(&small_bufs, &conn->in);
+		return 0;
+	}
+
+	case RESPONSE:
+		if (conn_write(idx) < 0) return -1;
+
+		if (conn->offset == conn->length) {
+			debug("Sent a response.\n");
+			if (conn->shared) {
+				conn->file->sending--;
+				conn->shared = 0;
+			}
+			if (conn->content_length) {
+				/* A multipart payload starts out with the framing for its first part. */
+				if (conn->ranges) conn->content_length = 0;
+				switch_phase(idx, PAYLOAD);
+			} else {
+				if (conn->file) put_file(conn->file);
+				conn->file = NULL;
+				switch_phase(idx, REQUEST);
+			}
+		}
+		return 0;
+
+	case PAYLOAD:
+		/* Whatever is buffered, file data or multipart framing, goes out first. */
+		if (conn->offset < conn->length) return conn_write(idx);
+
+		if (!conn->content_length) {
+			next_part(idx);
+			return 0;
+		}
+#if BRICK_SENDFILE
+		/* TLS has to see the payload, so it can't go around us. */
+		if (!conn->buffered && !secure(conn)) {
+			/* sendfile() can't be told not to wait for the disk, so it only gets what has been read ahead. */
+			if (!payload_warm(idx)) return prefetch(idx);
+			return conn_sendfile(idx);
+		}
+#endif
+		if (!conn->buf && !(conn->buf = get_buf(&payload_bufs))) return -1;
+		conn->out = conn->buf;
+		conn->offset = 0;
+#if BRICK_URING
+		return ring_payload(idx);
+#else
+		for (;;) {
+			size_t len = MIN(MIN(chunk_size(conn), conn->content_length), send_budget);
+			ssize_t n = payload_warm(idx) ? pread(conn->file->fd, conn->buf, len, conn->src_off) :
+				pread_nowait(conn->file->fd, conn->buf, len, conn->src_off);
+			if (!n) return -1;
+			if (n > 0) {
+				conn->src_off += n;
+				conn->length = n;
+				conn->sent += n;
+				conn->content_length -= n;
+				return 0;
+			}
+			switch (errno) {
+			case EINTR: continue;
+			case EAGAIN: return prefetch(idx);
+			default: return -1;
+			}
+		}
+#endif
+
+	default:
+		return -1;
+	}
+}
+
+/* Holds the connection back for us microseconds, until its client is within its byte rate again. */
+static void
+throttle(int idx, uint64_t us)
+{
+	struct conn *conn = &conns[idx];
+	metrics.limited[BYTE_LIMIT]++;
+	uncork(idx);
+	conn->throttled = conn->events;
+	want(idx, 0);
+	struct timer *t = &conn->timer;
+	cancel_timer(t);
+	t->at = now_ticks() + (us / 1000 + TIMER_TICK - 1) / TIMER_TICK;
+	add_timer(t);
+}
+
+/* Keep processing until the connection runs out of readiness for what it waits on.
+ * This is what makes edge-triggered notification safe. */
+static int
+handle_conn(int idx)
+{
+	struct conn *conn = &conns[idx];
+	if (conn->ready & (POLLERR | POLLHUP)) return -1;
+	while (conn->ready & conn->events) {
+		/* Only hold back what would actually go out, not the step to the next request. */
+		int sends = conn->phase != REQUEST && (conn->offset < conn->length || conn->content_length);
+		if (!client_bytes || !sends || !limited(peers[idx].client)) {
+			if (process_conn(idx) < 0) return -1;
+			continue;
+		}
+		struct client *client = peers[idx].client;
+		uint64_t now = now_us(), wait = bytes_wait(client, now);
+		if (wait) {
+			throttle(idx, wait);
+			break;
+		}
+		size_t before = conn->bytes;
+		send_budget = bytes_allowed(client, now);
+		int ret = process_conn(idx);
+		send_budget = SIZE_MAX;
+		if (ret < 0) return -1;
+		charge_bytes(client, conn->bytes - before, now);
+	}
+#if BRICK_URING
+	/* Out of what was received, and waiting for more: that takes another receive. */
+	if (conn->events & POLLIN && !(conn->ready & POLLIN) && !conn->recving) {
+		if (!ring_room(1)) return -1;
+		struct io_uring_sqe *sqe = get_sqe();
+		sqe->opcode    = IORING_OP_RECV;
+		sqe->fd        = conn->sock;
+		sqe->flags     = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->user_data = RING_TAG(RING_RECV, conn->gen, idx);
+		conn->recving = 1;
+	}
+#endif
+	rerank(idx);
+	return 0;
+}
+
+/* Hands the results of the I/O threads back to their connections. */
+static void
+finish_jobs(void)
+{
+#if BRICK_THREADS
+	char drain[64];
+	while (read(wake_fds[0], drain, sizeof drain) > 0);
+	pthread_mutex_lock(&io_lock);
+	struct job *job = done_jobs;
+	done_jobs = NULL;
+	pthread_mutex_unlock(&io_lock);
+
+	while (job) {
+		struct job *next = job->next;
+		int idx = job->idx;
+		job->done = 1;
+		if (idx < 0) {
+			free_job(job);
+			job = next;
+			continue;
+		}
+		struct conn *conn = &conns[idx];
+		if (job->kind == PREFETCH) {
+			conn->warm_from = job->off;
+			conn->warm_to   = job->off + job->len;
+			conn->job = NULL;
+			free_job(job);
+		}
+		if (conn->parked) {
+			conn->parked = 0;
+			want(idx, conn->phase == REQUEST ? POLLIN : POLLOUT);
+			/* Readiness may have come and gone while it was parked; trying is cheap. */
+			conn->ready |= conn->events;
+			if (handle_conn(idx) < 0) del_conn(idx);
+		}
+		job = next;
+	}
+#endif
+}
+
+/* Turns away a connection its client has no room left for. Over TLS that would take a handshake first. */
+static void
+refuse(int fd, int use_tls)
+{
+	metrics.limited[CONN_LIMIT]++;
+	if (!use_tls) {
+		char buf[512];
+		const char *msg = status_of(429)->name;
+		size_t len = format_head(buf, 429, "text/plain", "Retry-After: 1\r\nConnection: close\r\n", 4 + strlen(msg));
+		len += snprintf(buf + len, sizeof buf - len, "429 %s", msg);
+		/* Best effort; the socket buffer of a fresh connection has room for this. */
+		if (write(fd, buf, len) < 0) debug("Could not turn a connection away politely.\n");
+	}
+	close(fd);
+}
+
+/* Takes on a freshly accepted connection, unless its client has no room left for it. */
+static void
+admit(int fd, struct sockaddr_storage *addr, socklen_t addrlen, int use_tls)
+{
+	/* Before add_conn(), which might evict somebody to make room. */
+	if (client_conns && addr->ss_family != AF_UNIX) {
+		struct client *client = find_client(addr);
+		if (client && client->count >= client_conns) {
+			refuse(fd, use_tls);
+			return;
+		}
+	}
+	/* Serve the request right away instead of waiting another round for readiness. */
+	int idx = add_conn(fd, addr, addrlen, use_tls);
+	if (!(idx < 0) && handle_conn(idx) < 0) del_conn(idx);
+}
+
+#if BRICK_URING
+/* Has the kernel accept connections on portal i until further notice. */
+static void
+watch_portal(int i)
+{
+	if (!ring_room(1)) return;
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode       = IORING_OP_ACCEPT;
+	sqe->fd           = portals[i];
+	sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data    = RING_TAG(RING_ACCEPT, 0, i);
+}
+
+/* Has the kernel tell us whenever the I/O threads have finished something. */
+static void
+watch_wake(void)
+{
+	if (!ring_room(1)) return;
+	struct io_uring_sqe *sqe = get_sqe();
+	sqe->opcode        = IORING_OP_POLL_ADD;
+	sqe->fd            = wake_fds[0];
+	sqe->poll32_events = POLLIN;
+	sqe->len           = IORING_POLL_ADD_MULTI;
+	sqe->user_data     = RING_TAG(RING_WAKE, 0, 0);
+}
+
+/* Carries on from an operation that has completed, the way the event loop does from readiness. */
+static void
+complete(const struct io_uring_cqe *cqe)
+{
+	enum ring_op op = cqe->user_data >> 24 & 0xff;
+	int idx = cqe->user_data & 0xffffff;
+	int res = cqe->res;
+	/* Multishot operations go on until they say otherwise. */
+	int more = cqe->flags & IORING_CQE_F_MORE;
+
+	if (op == RING_ACCEPT) {
+		if (!more) watch_portal(idx);
+		if (res < 0) return;
+		/* A multishot accept has nowhere to put the address. */
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof addr;
+		if (getpeername(res, (void *) &addr, &addrlen) < 0) {
+			close(res);
+			return;
+		}
+		admit(res, &addr, addrlen, 0);
+		return;
+	}
+	if (op == RING_WAKE) {
+		if (!more) watch_wake();
+		finish_jobs();
+		return;
+	}
+
+	/* The connection may have been closed, and the slot even reused, since. */
+	struct conn *conn = &conns[idx];
+	if (conn->pos >= nconns || conn->gen != cqe->user_data >> 32) {
+		bury(cqe);
+		return;
+	}
+	switch (op) {
+	case RING_RECV:
+		conn->recving = 0;
+		if (res > 0) {
+			conn->held_bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			conn->held     = recv_bufs + (size_t) conn->held_bid * SCRATCH;
+			conn->held_len = res;
+			conn->ready |= POLLIN;
+		} else if (!res) {
+			conn->ready |= POLLHUP;
+		} else {
+			/* Out of buffers, or worse; read() will tell. */
+			conn->ready |= POLLIN;
+		}
+		break;
+	case RING_READ:
+		conn->writing--;
+		/* The file shrank underneath us, or worse. */
+		if (res <= 0) {
+			conn->ready |= POLLERR;
+			break;
+		}
+		conn->src_off += res;
+		conn->length = res;
+		conn->sent += res;
+		conn->content_length -= res;
+		break;
+	case RING_SEND:
+		conn->writing--;
+		if (res >= 0) {
+			conn->offset += res;
+			conn->bytes += res;
+			/* Charged once it went out, since it went out outside handle_conn(). */
+			struct client *client = peers[idx].client;
+			if (client_bytes && limited(client)) charge_bytes(client, res, now_us());
+		} else if (res != -ECANCELED) {
+			conn->ready |= POLLERR;
+		}
+		break;
+	default:
+		break;
+	}
+	if (conn->writing) return;
+	if (op != RING_RECV) conn->ready |= POLLOUT;
+	if (handle_conn(idx) < 0) del_conn(idx);
+}
+
+/* Goes through everything the kernel has completed. */
+static void
+reap(void)
+{
+	for (unsigned head = *cq_head; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+		struct io_uring_cqe cqe = cqes[head & cq_mask];
+		__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+		complete(&cqe);
+	}
+}
+#else
+static void
+accept_conns(int i)
+{
+	int portal = portals[i];
+#if BRICK_TLS
+	int use_tls = !plain_portals[i];
+#else
+	int use_tls = 0;
+#endif
+	for (;;) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof addr;
+#ifdef SOCK_NONBLOCK
+		int fd = accept4(portal, (void *) &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) break;
+#else
+		int fd = accept(portal, (void *) &addr, &addrlen);
+		if (fd < 0) break;
+		int flags = fcntl(fd, F_GETFL, 0);
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#endif
+		admit(fd, &addr, addrlen, use_tls);
+	}
+}
+#endif
+
+static void
+signal_handler(int sig)
+{
+	switch (sig) {
+	case SIGINT:
+	case SIGTERM: global_flags |= SHUTDOWN; break;
+	case SIGUSR1: global_flags |= RECONFIGURE; break;
+	case SIGUSR2: global_flags |= DUMP_METRICS; break;
+	}
+}
+
+#if BRICK_TLS
+static void
+rotate_ticket_key(void)
+{
+	/* Whoever gets here first rotates the key for everybody. */
+	unsigned seq = __atomic_load_n(&tickets->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1 || !__atomic_compare_exchange_n(&tickets->seq, &seq, seq + 1,
+		0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return;
+	memcpy(tickets->keys[0], tickets->keys[1], TLS_TICKET_KEY_SIZE);
+	if (getentropy(tickets->keys[1], TLS_TICKET_KEY_SIZE) < 0) {
+		fprintf(stderr, "getentropy: %s (non-fatal)\n", strerror(errno));
+	} else {
+		tickets->rev++;
+	}
+	tickets->time = time(NULL);
+	__atomic_store_n(&tickets->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+load_tickets(struct tickets *t)
+{
+	unsigned seq;
+	do {
+		seq = __atomic_load_n(&tickets->seq, __ATOMIC_ACQUIRE);
+		memcpy(t, tickets, sizeof *t);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq & 1 || seq != __atomic_load_n(&tickets->seq, __ATOMIC_RELAXED));
+}
+
+/* Hand the most recent ticket key(s) over to libtls, which keeps the older ones around. */
+static void
+add_ticket_keys(int previous)
+{
+	struct tickets t;
+	load_tickets(&t);
+	if (previous && t.rev > 1) {
+		if (tls_config_add_ticket_key(tls_cfg, t.rev - 1, t.keys[0], TLS_TICKET_KEY_SIZE) < 0) {
+			fprintf(stderr, "tls_config_add_ticket_key: %s (non-fatal)\n", tls_config_error(tls_cfg));
+		}
+	}
+	if (tls_config_add_ticket_key(tls_cfg, t.rev, t.keys[1], TLS_TICKET_KEY_SIZE) < 0) {
+		fprintf(stderr, "tls_config_add_ticket_key: %s (non-fatal)\n", tls_config_error(tls_cfg));
+	}
+	ticket_rev = t.rev;
+	explicit_bzero(&t, sizeof t);
+}
+
+static void
+init_tickets(void)
+{
+	tickets = mmap(NULL, sizeof *tickets, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (tickets == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (getentropy(tickets->sid, sizeof tickets->sid) < 0) {
+		fprintf(stderr, "getentropy: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+#endif
+
+static void
+reconfigure(void)
+{
+#if BRICK_TLS
+	fprintf(stderr, "Handshakes so far: %lu full, %lu resumed.\n", full_handshakes, resumed_handshakes);
+	if (portal_tls) tls_reset(portal_tls);
+	else portal_tls = tls_server();
+	struct tls_config *cfg = tls_config_new();
+	if (tls_config_set_ca_file(cfg, args[0]) < 0 ||
+		tls_config_set_cert_file(cfg, args[1]) < 0 ||
+		tls_config_set_key_file (cfg, args[2]) < 0 ||
+		tls_config_set_session_id(cfg, tickets->sid, sizeof tickets->sid) < 0 ||
+		tls_config_set_session_lifetime(cfg, TICKET_LIFETIME) < 0) {
+		fprintf(stderr, "tls configuration: %s (non-fatal)\n", tls_config_error(cfg));
+		tls_config_free(cfg);
+		return;
+	}
+	/* Keep our own reference, we add new ticket keys to it later. */
+	tls_config_free(tls_cfg);
+	tls_cfg = cfg;
+	add_ticket_keys(1);
+	if (tls_configure(portal_tls, tls_cfg) < 0) {
+		fprintf(stderr, "tls_configure: %s (non-fatal)\n", tls_error(portal_tls));
+	}
+#endif
+}
+
+/* A connection's deadline has passed. Slow but steady responses get another window. */
+static void
+expire(int idx)
+{
+	struct conn *conn = &conns[idx];
+	/* Waiting on the disk is our fault, not the client's. */
+	if (conn->parked) {
+		arm(idx, conn->phase == REQUEST ? REQUEST_TIMEOUT : SEND_WINDOW);
+		return;
+	}
+	/* Holding back was our doing too; the client gets a fresh window. */
+	if (conn->throttled) {
+		want(idx, conn->throttled);
+		conn->throttled = 0;
+		conn->ready |= conn->events;
+		conn->window_from = conn->bytes;
+		arm(idx, SEND_WINDOW);
+		if (handle_conn(idx) < 0) del_conn(idx);
+		return;
+	}
+	if (conn->phase != REQUEST && conn->bytes - conn->window_from >= (size_t) MIN_RATE * SEND_WINDOW) {
+		conn->window_from = conn->bytes;
+		arm(idx, SEND_WINDOW);
+		return;
+	}
+	debug("Timed out.\n");
+	metrics.timeouts[conn->phase]++;
+	del_conn(idx);
+}
+
+static void
+run_timers(void)
+{
+	uint64_t target = now_ticks();
+	if (!ntimers && target > wheel_now) wheel_now = target;
+	while (wheel_now < target) {
+		wheel_now++;
+		/* At the turn of a level, its timers for the next stretch move down to where they are due. */
+		for (int l = WHEEL_LEVELS - 1; l > 0; l--) {
+			if (wheel_now & (((uint64_t) 1 << (WHEEL_BITS * l)) - 1)) continue;
+			int slot = (wheel_now >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1);
+			while (wheel[l][slot]) {
+				struct timer *t = wheel[l][slot];
+				cancel_timer(t);
+				add_timer(t);
+			}
+		}
+		struct timer **due = &wheel[0][wheel_now & (WHEEL_SLOTS - 1)];
+		while (*due) {
+			struct timer *t = *due;
+			cancel_timer(t);
+			expire((struct conn *) ((char *) t - offsetof(struct conn, timer)) - conns);
+		}
 	}
-	return 0;
 }
 
-static const char *
-name_of_code(int code)
+/* Milliseconds until tick() has something to do, or -1 for never. */
+static int
+next_timeout(void)
 {
-	switch (code) {
-	case 200: return "OK";
-	case 400: return "Bad Request";
-	case 404: return "File Not Found";
-	default:  return "";
+	/* Pending log lines go out within a second or so. */
+	int timeout = log_head != log_tail ? 1000 : -1;
+	int ticks = next_timer();
+	if (ticks >= 0) {
+		int64_t ms = (int64_t) (wheel_now + ticks) * TIMER_TICK - (int64_t) (now_us() / 1000);
+		ms = ms < 0 ? 0 : ms;
+		timeout = timeout < 0 ? (int) ms : MIN(timeout, (int) ms);
+	}
+#if BRICK_TLS
+	if (tls_cfg) {
+		time_t left = tickets->time + TICKET_ROTATE - time(NULL);
+		int rotate = left > 0 ? left * 1000 : 0;
+		timeout = timeout < 0 ? rotate : MIN(timeout, rotate);
 	}
+#endif
+	return timeout;
 }
 
-static int
-load_content(int idx, const char **mime)
+static void
+tick(void)
 {
-	struct conn *conn = &conns[idx];
-	conn->content_length = 0;
-	*mime = "text/plain";
+	update_clock();
+	run_timers();
+	if (log_head - log_tail >= LOG_RING / 2 || (log_head != log_tail && cur_time != log_flushed)) {
+		flush_log();
+	}
+#if BRICK_TLS
+	if (!tls_cfg) return;
+	if (cur_time >= tickets->time + TICKET_ROTATE) {
+		fprintf(stderr, "Rotating session ticket key.\n");
+		rotate_ticket_key();
+	}
+	/* Some other worker might have rotated it. */
+	if (__atomic_load_n(&tickets->rev, __ATOMIC_RELAXED) != ticket_rev) {
+		add_ticket_keys(0);
+	}
+#endif
+}
 
-	if (parse_http(conn->scratch, req_keys, req_headers, req_path) < 0) return -1;
-	printf("Requested path: %s\n", req_path);
+static void
+teardown(void)
+{
+	for (int i = 0; i < nportals; i++) close(portals[i]);
+#if BRICK_TLS
+	tls_free(portal_tls);
+	tls_config_free(tls_cfg);
+	fprintf(stderr, "Handshakes: %lu full, %lu resumed.\n", full_handshakes, resumed_handshakes);
+#endif
+	while (nconns) del_conn(live[0]);
+	flush_log();
+	if (log_dropped) fprintf(stderr, "Dropped %lu access log lines.\n", log_dropped);
+	while (oldest_file) uncache_file(oldest_file);
+	drain_pool(&small_bufs);
+	drain_pool(&payload_bufs);
+	free(conns);
+	free(peers);
+	free(live);
+	free(clients);
+	free(client_table);
+	free(by_count);
+#if BRICK_POLL
+	free(all_pfds);
+#endif
+}
 
-	if (sanitize_path(req_path) < 0) return 400;
-	printf("Sanitized path: %s\n", req_path);
+/* Every connection needs a descriptor, on top of the cached files. */
+static void
+raise_fd_limit(void)
+{
+	struct rlimit rl;
+	rlim_t need = (rlim_t) max_conns + SPARE_FDS;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= need) return;
+	rl.rlim_cur = rl.rlim_max == RLIM_INFINITY ? need : MIN(need, rl.rlim_max);
+	if (setrlimit(RLIMIT_NOFILE, &rl) < 0) getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < need) {
+		max_conns = rl.rlim_cur > SPARE_FDS + 1 ? (int) (rl.rlim_cur - SPARE_FDS) : 1;
+		fprintf(stderr, "RLIMIT_NOFILE: only room for %d connections (non-fatal)\n", max_conns);
+	}
+}
 
-	conn->src = open(req_path, O_RDONLY);
-	if (conn->src < 0) return 404;
+static void
+find_portals(void)
+{
+	for (int fd = 3; nportals < MAX_PORTALS; fd++) {
+		int optval;
+		socklen_t optlen = sizeof (int);
+		if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &optval, &optlen) < 0 || !optval) break;
+		portals[nportals++] = fd;
+	}
+	if (!nportals) {
+		fprintf(stderr, "fd 3 must be a listening socket.\n");
+		exit(1);
+	}
 
-	*mime = "application/octet-stream";
-	size_t pathlen = strlen(req_path);
-	for (int i = 0; mime_types[i]; i += 2) {
-		size_t len = strlen(mime_types[i]);
-		if (pathlen < len) continue;
-		if (!strcmp(req_path + pathlen - len, mime_types[i])) {
-			*mime = mime_types[i+1];
-			break;
+#if BRICK_TLS
+	/* -p names a portal by its port number, or its path for a Unix socket. */
+	for (int i = 0; i < nportals; i++) {
+		struct sockaddr_storage addr;
+		socklen_t addrlen = sizeof addr;
+		char name[sizeof ((struct sockaddr_un *) 0)->sun_path + 1] = "";
+		memset(&addr, 0, sizeof addr);
+		getsockname(portals[i], (void *) &addr, &addrlen);
+		switch (addr.ss_family) {
+		case AF_INET:  snprintf(name, sizeof name, "%d", ntohs(((struct sockaddr_in *) &addr)->sin_port)); break;
+		case AF_INET6: snprintf(name, sizeof name, "%d", ntohs(((struct sockaddr_in6 *) &addr)->sin6_port)); break;
+		case AF_UNIX:  snprintf(name, sizeof name, "%.*s", (int) sizeof name - 1, ((struct sockaddr_un *) &addr)->sun_path); break;
+		}
+		for (int k = 0; k < nplain_names; k++) {
+			if (!strcmp(name, plain_names[k])) plain_portals[i] = 1;
 		}
 	}
+#endif
+}
 
-	struct stat meta;
-	fstat(conn->src, &meta);
-	// TODO err check
-	conn->content_length = meta.st_size;
+/* Sockets bound to the same address form a SO_REUSEPORT group.
+ * Each worker keeps one member of every group, round-robin. */
+static void
+split_portals(int worker)
+{
+	struct sockaddr_storage addrs[MAX_PORTALS];
+	for (int i = 0; i < nportals; i++) {
+		socklen_t addrlen = sizeof *addrs;
+		memset(&addrs[i], 0, sizeof *addrs);
+		getsockname(portals[i], (void *) &addrs[i], &addrlen);
+	}
+	int n = 0;
+	for (int i = 0; i < nportals; i++) {
+		int rank = 0, size = 0;
+		for (int j = 0; j < nportals; j++) {
+			if (memcmp(&addrs[i], &addrs[j], sizeof *addrs)) continue;
+			if (j < i) rank++;
+			size++;
+		}
+		if (rank == worker % size) {
+#if BRICK_TLS
+			plain_portals[n] = plain_portals[i];
+#endif
+			portals[n++] = portals[i];
+		} else {
+			close(portals[i]);
+		}
+	}
+	nportals = n;
+}
 
-	return 200;
+static void
+pin_worker(int worker)
+{
+#ifdef CPU_SET
+	cpu_set_t avail, set;
+	if (sched_getaffinity(0, sizeof avail, &avail) < 0) return;
+	int k = worker % CPU_COUNT(&avail);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &avail) || k--) continue;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof set, &set) < 0) {
+			fprintf(stderr, "sched_setaffinity: %s (non-fatal)\n", strerror(errno));
+		}
+		break;
+	}
+#else
+	(void) worker;
+#endif
 }
 
-static int
-process_request(int idx)
+static void *
+alloc_table(size_t n, size_t size)
 {
-	const char *mime;
-	int code = load_content(idx, &mime);
-	if (code < 0) return -1;
+	void *p = calloc(n, size);
+	if (!p) {
+		fprintf(stderr, "calloc: %s\n", strerror(errno));
+		exit(1);
+	}
+	return p;
+}
 
-	char date[50];
-	time_t t = time(NULL);
-	struct tm tm;
-	gmtime_r(&t, &tm);
-	strftime(date, sizeof date, "%a, %d %b %Y %T GMT", &tm);
+/* Sets up the tables for max_conns connections, all of them free. */
+static void
+alloc_conns(void)
+{
+	/* Rate limits outlive connections for a while, so their clients need room to linger. */
+	int nclients = client_reqs || client_bytes ? 2 * max_conns : max_conns;
+	conns = alloc_table(max_conns, sizeof *conns);
+	peers = alloc_table(max_conns, sizeof *peers);
+	live  = alloc_table(max_conns, sizeof *live);
+	clients = alloc_table(nclients, sizeof *clients);
+	for (client_mask = 1; client_mask < (unsigned) nclients; client_mask *= 2);
+	client_table = alloc_table(client_mask--, sizeof *client_table);
+	by_count = alloc_table(max_conns + 1, sizeof *by_count);
+	free_clients = idle_clients = oldest_idle = NULL;
+	max_count = 0;
+	for (int i = 0; i < max_conns; i++) {
+		live[i] = i;
+		conns[i].pos = i;
+	}
+	for (int i = 0; i < nclients; i++) {
+		clients[i].next = free_clients;
+		free_clients = &clients[i];
+	}
+}
 
-	struct conn *conn = &conns[idx];
-	conn->length = snprintf(conn->scratch, SCRATCH,
-		"HTTP/1.1 %03d %s\r\n"
-		"Server: brick\r\n"
-		"Date: %s\r\n"
-		"Content-Type: %s\r\n",
-		code, name_of_code(code), date, mime);
+#if BRICK_URING
+/* Sets up the rings and the buffers to receive into, and starts accepting. */
+static void
+start_ring(void)
+{
+	/* Room for a completion from every connection at once, so none ever has to wait in the kernel. */
+	struct io_uring_params p = {
+		.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SUBMIT_ALL |
+			IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+		.cq_entries = 2 * max_conns + RING_ENTRIES,
+	};
+	ring_fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &p);
+	if (ring_fd < 0 && errno == EINVAL) {
+		/* Before Linux 6.1, completions can't be held back until we come asking for them. */
+		p.flags &= ~(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+		ring_fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &p);
+	}
+	if (ring_fd < 0) {
+		fprintf(stderr, "io_uring_setup: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		fprintf(stderr, "io_uring: kernel too old\n");
+		exit(1);
+	}
 
-	if (code == 200) {
-		conn->length += snprintf(conn->scratch + conn->length, SCRATCH - conn->length,
-			"Content-Length: %llu\r\n"
-			"\r\n",
-			(long long unsigned) conn->content_length);
-	} else {
-		const char *msg = name_of_code(code);
-		conn->length += snprintf(conn->scratch + conn->length, SCRATCH - conn->length,
-			"Content-Length: %llu\r\n"
-			"\r\n"
-			"%03d %s",
-			(long long unsigned) (4 + strlen(msg)), code, msg);
+	size_t sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	char *rings = mmap(NULL, MAX(sq_size, cq_size), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof *sqes, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	for (recv_count = 1; recv_count < RECV_BUFS && recv_count < (unsigned) max_conns; recv_count *= 2);
+	recv_ring = mmap(NULL, recv_count * sizeof (struct io_uring_buf), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rings == MAP_FAILED || sqes == MAP_FAILED || recv_ring == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		exit(1);
 	}
+	sq_head    = (unsigned *) (rings + p.sq_off.head);
+	sq_tail    = (unsigned *) (rings + p.sq_off.tail);
+	sq_mask    = *(unsigned *) (rings + p.sq_off.ring_mask);
+	sq_entries = p.sq_entries;
+	sq_local   = *sq_tail;
+	/* Submissions are taken in the order they are queued. */
+	unsigned *array = (unsigned *) (rings + p.sq_off.array);
+	for (unsigned i = 0; i < sq_entries; i++) array[i] = i;
+	cq_head = (unsigned *) (rings + p.cq_off.head);
+	cq_tail = (unsigned *) (rings + p.cq_off.tail);
+	cq_mask = *(unsigned *) (rings + p.cq_off.ring_mask);
+	cqes    = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+
+	recv_bufs = alloc_table(recv_count, SCRATCH);
+	struct io_uring_buf_reg reg = { .ring_addr = (uintptr_t) recv_ring, .ring_entries = recv_count };
+	if (syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		fprintf(stderr, "io_uring_register: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (unsigned i = 0; i < recv_count; i++) recycle(i);
 
-	return 0;
+	for (int i = 0; i < nportals; i++) watch_portal(i);
+	if (io_threads) watch_wake();
 }
+#endif
 
-static int
-process_conn(int idx, int revents)
+static void
+serve(void)
 {
-	if (revents & POLLERR) return -1;
+	reconfigure();
 
-	struct conn *conn = &conns[idx];
-	switch (conn->phase) {
-	case REQUEST:
-		if (!(revents & POLLIN)) return 0;
-		if (conn_read(idx) < 0) return -1;
+	alloc_conns();
+#if BRICK_POLL
+	all_pfds = alloc_table(MAX_PORTALS + 1 + max_conns, sizeof *all_pfds);
+#endif
+	start_io_threads();
+	wheel_now = now_ticks();
 
-		if (conn->length >= 4 && !memcmp(conn->scratch + conn->length - 4, "\r\n\r\n", 4)) {
-			conn->scratch[conn->length - 2] = 0;
-			printf("Received a request.\n");
-			switch_phase(idx, RESPONSE);
-			return process_request(idx);
+#if BRICK_EPOLL
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		fprintf(stderr, "epoll_create1: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (int i = 0; i < nportals; i++) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.u64 = max_conns + i };
+#ifdef EPOLLEXCLUSIVE
+		/* Other workers may be waiting on the same socket; only wake one of us. */
+		ev.events |= EPOLLEXCLUSIVE;
+#endif
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, portals[i], &ev) < 0) {
+			fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+			exit(1);
 		}
-		return 0;
+	}
+	if (io_threads) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.u64 = max_conns + MAX_PORTALS };
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fds[0], &ev) < 0) {
+			fprintf(stderr, "epoll_ctl: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+#elif BRICK_POLL
+	for (int i = 0; i < nportals; i++) {
+		all_pfds[i].fd     = portals[i];
+		all_pfds[i].events = POLLIN;
+	}
+	/* Between the portals and the connections; poll() skips it if there are no I/O threads. */
+	all_pfds[nportals].fd     = io_threads ? wake_fds[0] : -1;
+	all_pfds[nportals].events = POLLIN;
+	conn_pfds = all_pfds + nportals + 1;
+#else
+	start_ring();
+#endif
 
-	case RESPONSE:
-		if (!(revents & POLLOUT)) return 0;
-		if (conn_write(idx) < 0) return -1;
+	for (;;) {
+#if BRICK_URING
+		int n = ring_enter(1, next_timeout());
+#elif BRICK_EPOLL
+		struct epoll_event evs[MAX_EVENTS];
+		int n = epoll_wait(epfd, evs, MAX_EVENTS, next_timeout());
+#else
+		int n = poll(all_pfds, nportals + 1 + nconns, next_timeout());
+#endif
 
-		if (conn->offset == conn->length) {
-			printf("Sent a response.\n");
-			switch_phase(idx, conn->content_length ? PAYLOAD : REQUEST);
+		if (global_flags & SHUTDOWN) {
+			fprintf(stderr, "Shutting down.\n");
+			teardown();
+			exit(0);
 		}
-		return 0;
+		if (global_flags & RECONFIGURE) {
+			fprintf(stderr, "Reconfiguring.\n");
+#if BRICK_TLS
+			/* When there is a supervisor, it has already rotated the key for all workers. */
+			if (!is_worker) rotate_ticket_key();
+#endif
+			reconfigure();
+			global_flags &= ~RECONFIGURE;
+		}
+		if (global_flags & DUMP_METRICS) {
+			global_flags &= ~DUMP_METRICS;
+			dump_metrics();
+		}
+		tick();
 
-	case PAYLOAD:
-		if (!(revents & POLLOUT)) return 0;
+		if (n < 0) continue;
 
-		if (conn->offset == conn->length) {
-			conn->offset = 0;
-			for (;;) {
-				ssize_t n = read(conn->src, conn->scratch, SCRATCH);
-				if (!n) return -1;
-				if (n > 0) {
-					conn->length = n;
-					break;
-				}
-				switch (errno) {
-				case EINTR: continue;
-				default: return -1;
-				}
+#if BRICK_URING
+		reap();
+#elif BRICK_EPOLL
+		for (int i = 0; i < n; i++) {
+			unsigned idx = (uint32_t) evs[i].data.u64;
+			if (idx == (unsigned) max_conns + MAX_PORTALS) {
+				finish_jobs();
+				continue;
+			}
+			if (idx >= (unsigned) max_conns) {
+				accept_conns(idx - max_conns);
+				continue;
 			}
-			conn->content_length -= conn->length;
+			/* The slot may have been freed (or even reused) earlier in this batch. */
+			if (conns[idx].pos >= nconns || conns[idx].gen != evs[i].data.u64 >> 32) continue;
+			conns[idx].ready |= evs[i].events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP);
+			if (handle_conn(idx) < 0) del_conn(idx);
 		}
-
-		if (conn_write(idx) < 0) return -1;
-
-		if (conn->offset == conn->length && !conn->content_length) {
-			printf("Sent the payload.\n");
-			switch_phase(idx, REQUEST);
-			close(conn->src);
+#else
+		for (int i = 0; i < nportals; i++) {
+			if (all_pfds[i].revents & POLLIN) accept_conns(i);
 		}
-		return 0;
+		if (all_pfds[nportals].revents & POLLIN) finish_jobs();
 
-	default:
-		return -1;
+		for (int i = 0; i < nconns; i++) {
+			int idx = live[i];
+			conns[idx].ready = conn_pfds[i].revents;
+			if (!conns[idx].ready) continue;
+			if (handle_conn(idx) < 0) {
+				del_conn(idx);
+				i--;
+			}
+		}
+#endif
 	}
 }
 
-static void
-signal_handler(int sig)
+/* A worker's metrics as the supervisor reads them. */
+struct dump {
+	char *text;
+	size_t len;
+	int state; /* 0 while reading, 1 once complete, -1 if given up on */
+};
+
+/* Finds the line of dump that starts with the len bytes of type, where type starts a TYPE line. */
+static const char *
+find_family(const char *dump, const char *type, size_t len)
 {
-	switch (sig) {
-	case SIGINT:
-	case SIGTERM: global_flags |= SHUTDOWN; break;
-	case SIGUSR1: global_flags |= RECONFIGURE; break;
+	for (const char *p = dump; (p = strstr(p, "# TYPE ")); p++) {
+		if ((p == dump || p[-1] == '\n') && !strncmp(p, type, len)) return p;
 	}
+	return NULL;
 }
 
+/* Has the workers dump their metrics and writes them to stderr as one exposition;
+ * the text format wants all samples of a family together, under a single TYPE line. */
 static void
-reconfigure(void)
+gather_metrics(const pid_t *workers, const int *from, int n)
 {
-#if BRICK_TLS
-	if (portal_tls) tls_reset(portal_tls);
-	else portal_tls = tls_server();
-	struct tls_config *tls_cfg = tls_config_new();
-	if (tls_config_set_ca_file(tls_cfg, args[1]) < 0 ||
-		tls_config_set_cert_file(tls_cfg, args[2]) < 0 ||
-		tls_config_set_key_file (tls_cfg, args[3]) < 0) {
-		fprintf(stderr, "tls configuration: %s (non-fatal)\n", tls_config_error(tls_cfg));
-		tls_config_free(tls_cfg);
-		return;
+	struct dump dumps[MAX_WORKERS] = { 0 };
+	char chunk[1 << 12];
+
+	/* Anything still in the pipes is left over from a dump we gave up on. */
+	for (int k = 0; k < n; k++) {
+		while (read(from[k], chunk, sizeof chunk) > 0);
+		kill(workers[k], SIGUSR2);
 	}
-	if (tls_configure(portal_tls, tls_cfg) < 0) {
-		fprintf(stderr, "tls_configure: %s (non-fatal)\n", tls_error(portal_tls));
+
+	uint64_t deadline = now_us() + DUMP_TIMEOUT * 1000;
+	for (int left = n; left;) {
+		struct pollfd pfds[MAX_WORKERS];
+		int which[MAX_WORKERS], np = 0;
+		for (int k = 0; k < n; k++) {
+			if (dumps[k].state) continue;
+			pfds[np] = (struct pollfd) { .fd = from[k], .events = POLLIN };
+			which[np++] = k;
+		}
+		uint64_t now = now_us();
+		if (now >= deadline || poll(pfds, np, (deadline - now + 999) / 1000) <= 0) break;
+		for (int i = 0; i < np; i++) {
+			if (!pfds[i].revents) continue;
+			struct dump *d = &dumps[which[i]];
+			ssize_t got = read(pfds[i].fd, chunk, sizeof chunk);
+			if (got < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+			char *end = got > 0 ? memchr(chunk, 0, got) : NULL;
+			size_t take = end ? (size_t) (end - chunk) : got > 0 ? (size_t) got : 0;
+			char *text = got > 0 ? realloc(d->text, d->len + take + 1) : NULL;
+			if (!text) {
+				/* The worker went away, or we have no room for what it says. */
+				d->state = -1;
+				left--;
+				continue;
+			}
+			memcpy(text + d->len, chunk, take);
+			d->text = text;
+			d->len += take;
+			d->text[d->len] = 0;
+			if (end) {
+				d->state = 1;
+				left--;
+			}
+		}
 	}
-	tls_config_free(tls_cfg);
-#endif
+
+	char *text;
+	size_t len;
+	FILE *f = open_memstream(&text, &len);
+	if (!f) {
+		fprintf(stderr, "open_memstream: %s (non-fatal)\n", strerror(errno));
+	} else {
+		for (int k = 0; k < n; k++) {
+			if (dumps[k].state != 1) continue;
+			for (const char *type = dumps[k].text; (type = find_family(type, "# TYPE ", 7)); type++) {
+				size_t tlen = strcspn(type, "\n") + 1;
+				/* Families an earlier worker had too have been written out already. */
+				int seen = 0;
+				for (int j = 0; j < k && !seen; j++) {
+					seen = dumps[j].state == 1 && find_family(dumps[j].text, type, tlen);
+				}
+				if (seen) continue;
+				fwrite(type, 1, tlen, f);
+				for (int j = k; j < n; j++) {
+					const char *fam = dumps[j].state == 1 ? find_family(dumps[j].text, type, tlen) : NULL;
+					if (!fam) continue;
+					fam += tlen;
+					const char *next = find_family(fam, "# TYPE ", 7);
+					fwrite(fam, 1, next ? (size_t) (next - fam) : strlen(fam), f);
+				}
+			}
+		}
+		if (fclose(f) == 0) write_all(2, text, len);
+		free(text);
+	}
+	for (int k = 0; k < n; k++) free(dumps[k].text);
 }
 
+/* Forks the workers and relays signals to them until they have all exited.
+ * Signals are blocked and taken synchronously, so none can slip through. */
 static void
-teardown(void)
+supervise(int nworkers, int pin, const sigset_t *sigs)
 {
-	close(all_pfds[0].fd);
+	pid_t workers[MAX_WORKERS];
+	int dumps[MAX_WORKERS][2], from[MAX_WORKERS];
+	int alive = 0;
+
+	for (int k = 0; k < nworkers; k++) {
+		if (pipe(dumps[k]) < 0) {
+			fprintf(stderr, "pipe: %s\n", strerror(errno));
+			exit(1);
+		}
+		/* A worker would rather lose its dump than wait on a supervisor that isn't reading. */
+		for (int i = 0; i < 2; i++) fcntl(dumps[k][i], F_SETFL, fcntl(dumps[k][i], F_GETFL) | O_NONBLOCK);
+	}
+
+	fflush(NULL);
+	for (int k = 0; k < nworkers; k++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "fork: %s\n", strerror(errno));
+			global_flags |= SHUTDOWN;
+			break;
+		}
+		if (!pid) {
+			is_worker = 1;
+			worker_id = k;
+			for (int j = 0; j < nworkers; j++) {
+				close(dumps[j][0]);
+				if (j != k) close(dumps[j][1]);
+			}
+			metrics_fd = dumps[k][1];
+			split_portals(k);
+			if (pin) pin_worker(k);
+			sigprocmask(SIG_UNBLOCK, sigs, NULL);
+			serve();
+		}
+		from[alive] = dumps[k][0];
+		workers[alive++] = pid;
+	}
+	for (int i = 0; i < nportals; i++) close(portals[i]);
+	for (int k = 0; k < nworkers; k++) {
+		close(dumps[k][1]);
+		if (k >= alive) close(dumps[k][0]);
+	}
+
+	for (int sig = global_flags & SHUTDOWN ? SIGTERM : 0; alive;) {
+		switch (sig) {
+		case SIGCHLD:
+			for (pid_t pid; (pid = waitpid(-1, NULL, WNOHANG)) > 0;) {
+				for (int k = 0; k < alive; k++) {
+					if (workers[k] != pid) continue;
+					close(from[k]);
+					from[k] = from[alive - 1];
+					workers[k] = workers[--alive];
+					fprintf(stderr, "Worker %d exited.\n", (int) pid);
+					break;
+				}
+			}
+			break;
+		case SIGUSR1:
 #if BRICK_TLS
-	tls_free(portal_tls);
+			rotate_ticket_key();
 #endif
-	for (int i = nconns; i--;) del_conn(i);
-	for (int i = 0; i < MAX_CONNS; i++) free(conns[i].scratch);
+			/* fallthrough */
+		case SIGINT:
+		case SIGTERM:
+			for (int k = 0; k < alive; k++) kill(workers[k], sig);
+			break;
+		case SIGUSR2:
+			gather_metrics(workers, from, alive);
+			break;
+		}
+		if (alive) sig = sigwaitinfo(sigs, NULL);
+	}
+	exit(0);
 }
 
 int
-main(int argc, const char **argv)
+main(int argc, char **argv)
 {
-	int optval;
-	socklen_t optlen = sizeof (int);
-	if (getsockopt(3, SOL_SOCKET, SO_ACCEPTCONN, &optval, &optlen) < 0 || !optval) {
-		fprintf(stderr, "fd 3 must be a listening socket.\n");
+	int nworkers = 0, pin = 0;
+
+	ARGBEGIN {
+	case 'w':
+		nworkers = atoi(EARGF(usage()));
+		if (nworkers < 1 || nworkers > MAX_WORKERS) {
+			usage();
+			exit(1);
+		}
+		break;
+	case 'c':
+		pin = 1;
+		break;
+	case 'm':
+		max_conns = atoi(EARGF(usage()));
+		if (max_conns < 1 || max_conns > MAX_CONNS) {
+			usage();
+			exit(1);
+		}
+		break;
+	case 'r':
+		client_reqs = atoi(EARGF(usage()));
+		if (client_reqs < 1 || client_reqs > 1000000) {
+			usage();
+			exit(1);
+		}
+		break;
+	case 'b':
+		client_bytes = atoi(EARGF(usage()));
+		if (client_bytes < 1) {
+			usage();
+			exit(1);
+		}
+		break;
+	case 'l':
+		client_conns = atoi(EARGF(usage()));
+		if (client_conns < 1) {
+			usage();
+			exit(1);
+		}
+		break;
+#if BRICK_TLS
+	case 'p':
+		if (nplain_names == MAX_PORTALS) {
+			usage();
+			exit(1);
+		}
+		plain_names[nplain_names++] = EARGF(usage());
+		break;
+#endif
+	default:
+		usage();
 		exit(1);
-	}
+	} ARGEND
 
 	args = argv;
 	if (argc != NUM_ARGS) {
@@ -602,62 +3906,47 @@ main(int argc, const char **argv)
 		exit(1);
 	}
 
-	all_pfds[0].fd     = 3;
-	all_pfds[0].events = POLLIN;
+	find_portals();
+	raise_fd_limit();
+
+	unsigned char nonce[sizeof boundary / 2];
+	if (getentropy(nonce, sizeof nonce) < 0) {
+		fprintf(stderr, "getentropy: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (size_t i = 0; i < sizeof nonce; i++) {
+		snprintf(boundary + 2 * i, 3, "%02x", nonce[i]);
+	}
+	snprintf(multipart_type, sizeof multipart_type, "multipart/byteranges; boundary=%s", boundary);
 	
 	setlocale(LC_ALL, "C");
+	init_key_slots();
 
-	reconfigure();
+#if BRICK_TLS
+	init_tickets();
+	rotate_ticket_key();
+#endif
 
 	struct sigaction sa = { 0 };
 	sa.sa_handler = signal_handler;
 	sigaction(SIGINT,  &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 	sigaction(SIGUSR1, &sa, NULL);
-
-	for (int i = 0; i < MAX_CONNS; i++) {
-		conns[i].scratch = malloc(SCRATCH);
-		if (!conns[i].scratch) {
-			fprintf(stderr, "malloc: %s\n", strerror(errno));
-			exit(1);
-		}
-	}
-
-	for (;;) {
-		int n = poll(all_pfds, NUM_PORTALS + nconns, -1);
-
-		if (global_flags & SHUTDOWN) {
-			printf("Shutting down.\n");
-			teardown();
-			exit(0);
-		}
-		if (global_flags & RECONFIGURE) {
-			printf("Reconfiguring.\n");
-			reconfigure();
-			global_flags &= ~RECONFIGURE;
-		}
-
-		if (n < 0) continue;
-
-		if (all_pfds[0].revents & POLLIN) {
-			for (;;) {
-				struct sockaddr_storage addr;
-				socklen_t addrlen = sizeof addr;
-				int fd = accept(all_pfds[0].fd, (void *) &addr, &addrlen);
-				if (fd < 0) break;
-				add_conn(fd, &addr, addrlen);
-			}
-		}
-
-		for (int i = 0; i < nconns; i++) {
-			if (conn_pfds[i].revents) {
-				if (process_conn(i, conn_pfds[i].revents) < 0) {
-					del_conn(i);
-					i--;
-					continue;
-				}
-			}
-		}
-	}
+	sigaction(SIGUSR2, &sa, NULL);
+	/* sendfile() has no MSG_NOSIGNAL, so a client hanging up must not kill us. */
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	if (!nworkers) serve();
+
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGUSR1);
+	sigaddset(&sigs, SIGUSR2);
+	sigaddset(&sigs, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+	supervise(nworkers, pin, &sigs);
+	return 0;
 }
-
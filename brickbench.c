@@ -0,0 +1,664 @@
+/* End-to-end load generator: starts brick behind grantsocket on a generated
+ * docroot and hammers it with keep-alive connections. */
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+
+#include "arg.h"
+
+#if BRICK_TLS
+# include <tls.h>
+# define NUM_ARGS 3
+# define SERVER "bricks"
+#else
+# define NUM_ARGS 0
+# define SERVER "brick"
+#endif
+
+#define MAX_CLASSES   8
+#define FILES_PER_CLASS 16
+#define MAX_EVENTS    256
+#define HEAD_BUF      4096
+#define DRAIN_BUF     (1 << 16)
+#define HIST_SUB      16 /* linear buckets per power of two */
+#define HIST_BUCKETS  (40 * HIST_SUB)
+#define STARTUP_TRIES 200
+#define SOURCE_NET    0x7f010000 /* 127.1.0.0, measured connections come from here during a flood */
+
+enum state { CONNECTING, SENDING, HEAD, BODY };
+
+struct client {
+	int fd;
+#if BRICK_TLS
+	struct tls *tls;
+#endif
+	int flood;    /* only here to take up a slot until evicted */
+	uint32_t source; /* loopback address to connect from, 0 for any */
+	enum state state;
+	unsigned events;
+	const char *req;
+	size_t req_len, req_off;
+	char head[HEAD_BUF];
+	size_t head_len;
+	size_t body_left;
+	uint64_t started;
+};
+
+struct class {
+	size_t size;
+	unsigned weight;
+	char reqs[FILES_PER_CLASS][64];
+};
+
+struct result {
+	double rps, mbps, p50, p99, p999;
+};
+
+char *argv0;
+
+static char **args;
+static struct class classes[MAX_CLASSES];
+static int nclasses;
+static unsigned total_weight;
+static char docroot[] = "/tmp/brickbench.XXXXXX";
+static int epfd;
+static struct sockaddr_in server_addr;
+static uint64_t deadline;
+
+#if BRICK_TLS
+static struct tls_config *tls_cfg;
+#endif
+
+static unsigned long requests, errors, dropped, connects, evictions;
+static unsigned long long bytes;
+static unsigned long hist[HIST_BUCKETS + 1];
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-c connections] [-t seconds] [-p port] [-z size:weight,...]"
+		" [-w workers] [-m max-connections] [-f flood-connections] [-x bindir]"
+		" [-b baseline-file] [-s save-file]"
+#if BRICK_TLS
+		" ca-file cert-file key-file"
+#endif
+		"\n", argv0);
+}
+
+static void
+die(const char *msg)
+{
+	fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+	exit(1);
+}
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+hist_bucket(uint64_t us)
+{
+	if (us < HIST_SUB) return us;
+	int shift = 63 - __builtin_clzll(us) - __builtin_ctz(HIST_SUB);
+	uint64_t i = (uint64_t) shift * HIST_SUB + (us >> shift);
+	return i < HIST_BUCKETS ? i : HIST_BUCKETS;
+}
+
+static uint64_t
+hist_bound(int i)
+{
+	if (i < HIST_SUB) return i;
+	int shift = i / HIST_SUB - 1;
+	return ((uint64_t) (HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+/* Latency below which the given fraction of requests finished, in milliseconds. */
+static double
+percentile(double q)
+{
+	unsigned long want = (unsigned long) (q * requests), seen = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > want) return hist_bound(i) / 1000.0;
+	}
+	return hist_bound(HIST_BUCKETS - 1) / 1000.0;
+}
+
+static size_t
+parse_size(const char *s, char **end)
+{
+	size_t n = strtoul(s, end, 10);
+	switch (**end) {
+	case 'k': case 'K': (*end)++; return n << 10;
+	case 'm': case 'M': (*end)++; return n << 20;
+	default: return n;
+	}
+}
+
+/* Reads a mix like "1k:70,16k:25,1m:5". */
+static void
+parse_mix(const char *mix)
+{
+	nclasses = 0;
+	total_weight = 0;
+	for (const char *p = mix; *p;) {
+		char *end;
+		if (nclasses == MAX_CLASSES) break;
+		struct class *c = &classes[nclasses];
+		c->size = parse_size(p, &end);
+		if (*end != ':') {
+			usage();
+			exit(1);
+		}
+		c->weight = strtoul(end + 1, &end, 10);
+		if (!c->weight || (*end && *end != ',')) {
+			usage();
+			exit(1);
+		}
+		total_weight += c->weight;
+		nclasses++;
+		p = *end ? end + 1 : end;
+	}
+	if (!nclasses) {
+		usage();
+		exit(1);
+	}
+}
+
+static void
+make_docroot(void)
+{
+	if (!mkdtemp(docroot)) die("mkdtemp");
+	char *data = malloc(DRAIN_BUF);
+	if (!data) die("malloc");
+	for (size_t i = 0; i < DRAIN_BUF; i++) data[i] = 'a' + i % 26;
+
+	for (int k = 0; k < nclasses; k++) {
+		for (int i = 0; i < FILES_PER_CLASS; i++) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof path, "%s/c%d-%d.bin", docroot, k, i);
+			int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0) die("open");
+			for (size_t left = classes[k].size; left;) {
+				ssize_t n = write(fd, data, left < DRAIN_BUF ? left : DRAIN_BUF);
+				if (n < 0) die("write");
+				left -= n;
+			}
+			close(fd);
+			snprintf(classes[k].reqs[i], sizeof classes[k].reqs[i],
+				"GET /c%d-%d.bin HTTP/1.1\r\nHost: localhost\r\n\r\n", k, i);
+		}
+	}
+	free(data);
+}
+
+static void
+remove_docroot(void)
+{
+	for (int k = 0; k < nclasses; k++) {
+		for (int i = 0; i < FILES_PER_CLASS; i++) {
+			char path[PATH_MAX];
+			snprintf(path, sizeof path, "%s/c%d-%d.bin", docroot, k, i);
+			unlink(path);
+		}
+	}
+	rmdir(docroot);
+}
+
+static pid_t
+start_server(const char *bindir, int port, const char *workers, const char *max_conns)
+{
+	char grantsocket[PATH_MAX], server[PATH_MAX], addr[32];
+	snprintf(grantsocket, sizeof grantsocket, "%s/grantsocket", bindir);
+	snprintf(server, sizeof server, "%s/" SERVER, bindir);
+	char *abs_grantsocket = realpath(grantsocket, NULL);
+	char *abs_server = realpath(server, NULL);
+	if (!abs_grantsocket || !abs_server) die("realpath");
+	snprintf(addr, sizeof addr, "127.0.0.1:%d", port);
+
+	char *argv[20];
+	int n = 0;
+	argv[n++] = abs_grantsocket;
+	if (workers) {
+		/* One listening socket per worker, so the kernel spreads the load. */
+		argv[n++] = "-n";
+		argv[n++] = (char *) workers;
+	}
+	argv[n++] = addr;
+	argv[n++] = abs_server;
+	if (workers) {
+		argv[n++] = "-w";
+		argv[n++] = (char *) workers;
+	}
+	if (max_conns) {
+		argv[n++] = "-m";
+		argv[n++] = (char *) max_conns;
+	}
+	/* The server runs in the docroot, so certificate paths must not be relative. */
+	for (int i = 0; i < NUM_ARGS; i++) {
+		if (!(argv[n++] = realpath(args[i], NULL))) die("realpath");
+	}
+	argv[n] = NULL;
+
+	pid_t pid = fork();
+	if (pid < 0) die("fork");
+	if (!pid) {
+		int null = open("/dev/null", O_WRONLY);
+		if (null >= 0) dup2(null, 1);
+		if (chdir(docroot) < 0) die("chdir");
+		execv(argv[0], argv);
+		die("execv");
+	}
+	free(abs_grantsocket);
+	free(abs_server);
+	return pid;
+}
+
+static void
+stop_server(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+/* Waits until the server takes connections. */
+static int
+await_server(void)
+{
+	for (int i = 0; i < STARTUP_TRIES; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) die("socket");
+		int ok = connect(fd, (void *) &server_addr, sizeof server_addr) == 0;
+		close(fd);
+		if (ok) return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+static void
+watch(struct client *c, unsigned events)
+{
+	if (c->events == events) return;
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	epoll_ctl(epfd, c->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev);
+	c->events = events;
+}
+
+static void
+open_client(struct client *c)
+{
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (c->fd < 0) die("socket");
+	c->events = 0;
+	if (c->source) {
+		struct sockaddr_in src = { .sin_family = AF_INET };
+		src.sin_addr.s_addr = htonl(c->source);
+		if (bind(c->fd, (void *) &src, sizeof src) < 0) die("bind");
+	}
+	connects++;
+	c->state = CONNECTING;
+	if (connect(c->fd, (void *) &server_addr, sizeof server_addr) < 0 && errno != EINPROGRESS) {
+		errors++;
+	}
+	watch(c, EPOLLOUT);
+}
+
+static void
+close_client(struct client *c)
+{
+#if BRICK_TLS
+	if (c->tls) {
+		tls_free(c->tls);
+		c->tls = NULL;
+	}
+#endif
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+}
+
+/* Like read()/write(): >0 bytes moved, 0 for end of stream, -1 for an error,
+ * and -2 when we have to wait for readiness, which is then already requested. */
+static ssize_t
+client_io(struct client *c, int writing, void *buf, size_t len)
+{
+#if BRICK_TLS
+	ssize_t n = writing ? tls_write(c->tls, buf, len) : tls_read(c->tls, buf, len);
+	switch (n) {
+	case TLS_WANT_POLLIN:  watch(c, EPOLLIN);  return -2;
+	case TLS_WANT_POLLOUT: watch(c, EPOLLOUT); return -2;
+	default: return n;
+	}
+#else
+	for (;;) {
+		ssize_t n = writing ? write(c->fd, buf, len) : read(c->fd, buf, len);
+		if (n >= 0) return n;
+		if (errno == EINTR) continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			watch(c, writing ? EPOLLOUT : EPOLLIN);
+			return -2;
+		}
+		return -1;
+	}
+#endif
+}
+
+static void
+next_request(struct client *c)
+{
+	unsigned pick = rand() % total_weight;
+	int k = 0;
+	while (pick >= classes[k].weight) pick -= classes[k++].weight;
+	c->req = classes[k].reqs[rand() % FILES_PER_CLASS];
+	c->req_len = strlen(c->req);
+	c->req_off = 0;
+	c->head_len = 0;
+	c->state = SENDING;
+	c->started = now_us();
+}
+
+/* Returns the length of the head and sets the body length, 0 if incomplete, -1 if bogus. */
+static ssize_t
+parse_head(struct client *c)
+{
+	char *end = memmem(c->head, c->head_len, "\r\n\r\n", 4);
+	if (!end) return c->head_len == HEAD_BUF ? -1 : 0;
+	*end = 0;
+	if (strncmp(c->head, "HTTP/1.1 200 ", 13)) return -1;
+	const char *cl = strcasestr(c->head, "\r\nContent-Length:");
+	if (!cl) return -1;
+	c->body_left = strtoull(cl + 17, NULL, 10);
+	return end + 4 - c->head;
+}
+
+static void
+finish_request(struct client *c)
+{
+	uint64_t us = now_us() - c->started;
+	hist[hist_bucket(us)]++;
+	requests++;
+	if (now_us() < deadline) {
+		next_request(c);
+	} else {
+		close_client(c);
+	}
+}
+
+/* Moves the client along as far as it can go without blocking. Returns -1 if it has to go. */
+static int
+step(struct client *c)
+{
+	static char drain[DRAIN_BUF];
+	ssize_t n;
+
+	if (c->state == CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof err;
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) return -1;
+#if BRICK_TLS
+		if (!(c->tls = tls_client()) || tls_configure(c->tls, tls_cfg) < 0 ||
+			tls_connect_socket(c->tls, c->fd, "localhost") < 0) return -1;
+#endif
+		if (c->flood) {
+			/* Just enough of a request to get accepted, then nothing more. */
+#if BRICK_TLS
+			static const char partial[] = "\x16\x03\x01";
+			write(c->fd, partial, sizeof partial - 1);
+#else
+			write(c->fd, "GET /", 5);
+#endif
+			watch(c, EPOLLIN);
+			c->state = HEAD;
+			return 0;
+		}
+		next_request(c);
+	}
+
+	if (c->flood) {
+		/* The server only ever talks to us by hanging up. */
+		n = read(c->fd, drain, sizeof drain);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		evictions++;
+		return -1;
+	}
+
+	for (;;) {
+		switch (c->state) {
+		case CONNECTING:
+			return -1;
+		case SENDING:
+			n = client_io(c, 1, (char *) c->req + c->req_off, c->req_len - c->req_off);
+			if (n == -2) return 0;
+			if (n <= 0) return -1;
+			c->req_off += n;
+			if (c->req_off == c->req_len) c->state = HEAD;
+			break;
+		case HEAD:
+			n = client_io(c, 0, c->head + c->head_len, HEAD_BUF - c->head_len);
+			if (n == -2) return 0;
+			if (n <= 0) return -1;
+			c->head_len += n;
+			bytes += n;
+			ssize_t h = parse_head(c);
+			if (h < 0) return -1;
+			if (!h) break;
+			/* Part of the body may have come along with the head. */
+			size_t extra = c->head_len - h;
+			if (extra > c->body_left) return -1;
+			c->body_left -= extra;
+			c->state = BODY;
+			if (!c->body_left) {
+				finish_request(c);
+				if (c->fd < 0) return 0;
+			}
+			break;
+		case BODY:
+			n = client_io(c, 0, drain, c->body_left < DRAIN_BUF ? c->body_left : DRAIN_BUF);
+			if (n == -2) return 0;
+			if (n <= 0) return -1;
+			c->body_left -= n;
+			bytes += n;
+			if (!c->body_left) {
+				finish_request(c);
+				if (c->fd < 0) return 0;
+			}
+			break;
+		}
+	}
+}
+
+static void
+raise_fd_limit(rlim_t need)
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= need) return;
+	rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > need ? need : rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static struct result
+run(int nconns, int nflood, int seconds)
+{
+	struct client *clients = calloc(nconns + nflood, sizeof *clients);
+	if (!clients) die("calloc");
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) die("epoll_create1");
+
+	uint64_t begin = now_us();
+	deadline = begin + (uint64_t) seconds * 1000000;
+	int alive = nconns;
+	for (int i = 0; i < nconns + nflood; i++) {
+		clients[i].flood = i >= nconns;
+		/* evict() picks on the address with the most connections. That has to be the flood even while
+		 * some of its connections are on their way back, so every measured one gets an address of its own. */
+		if (clients[i].flood) clients[i].source = INADDR_LOOPBACK + 1;
+		else if (nflood) clients[i].source = SOURCE_NET + i;
+		open_client(&clients[i]);
+	}
+
+	while (alive) {
+		struct epoll_event evs[MAX_EVENTS];
+		int n = epoll_wait(epfd, evs, MAX_EVENTS, 100);
+		uint64_t now = now_us();
+		/* Give stragglers a moment past the deadline, but not forever. */
+		if (now > deadline + 2000000) break;
+		for (int i = 0; i < n; i++) {
+			struct client *c = evs[i].data.ptr;
+			if (c->fd < 0 || step(c) == 0) {
+				if (c->fd < 0 && !c->flood) alive--;
+				continue;
+			}
+			close_client(c);
+			if (now < deadline) {
+				/* Hung up on before answering: evict() chose this one over the flood. */
+				if (!c->flood && c->state == HEAD && !c->head_len) dropped++;
+				else if (!c->flood && c->state != CONNECTING) errors++;
+				open_client(c);
+			} else if (!c->flood) {
+				alive--;
+			}
+		}
+	}
+	uint64_t elapsed = now_us() - begin;
+
+	for (int i = 0; i < nconns + nflood; i++) {
+		if (clients[i].fd >= 0) close_client(&clients[i]);
+	}
+	close(epfd);
+	free(clients);
+
+	double secs = elapsed / 1e6;
+	return (struct result) {
+		.rps  = requests / secs,
+		.mbps = bytes / secs / (1 << 20),
+		.p50  = percentile(0.5),
+		.p99  = percentile(0.99),
+		.p999 = percentile(0.999),
+	};
+}
+
+static void
+report(const struct result *r, const char *baseline)
+{
+	struct result base;
+	int have_base = 0;
+	FILE *f = baseline ? fopen(baseline, "r") : NULL;
+	if (f) {
+		have_base = fscanf(f, "%lf %lf %lf %lf %lf",
+			&base.rps, &base.mbps, &base.p50, &base.p99, &base.p999) == 5;
+		fclose(f);
+	}
+
+	printf("requests   %lu (%lu errors, %lu connects)\n", requests, errors, connects);
+	if (evictions) printf("evictions  %lu flood connections dropped by the server\n", evictions);
+	if (dropped) printf("dropped    %lu measured connections dropped by the server\n", dropped);
+#define LINE(name, field, unit) \
+	printf("%-10s %10.2f %-5s", name, r->field, unit); \
+	if (have_base) printf(" %+6.1f%%", (r->field - base.field) / base.field * 100); \
+	printf("\n");
+	LINE("req/s",  rps,  "");
+	LINE("MB/s",   mbps, "");
+	LINE("p50",    p50,  "ms");
+	LINE("p99",    p99,  "ms");
+	LINE("p999",   p999, "ms");
+#undef LINE
+}
+
+static void
+save(const struct result *r, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) die("fopen");
+	fprintf(f, "%.2f %.2f %.3f %.3f %.3f\n", r->rps, r->mbps, r->p50, r->p99, r->p999);
+	fclose(f);
+}
+
+int
+main(int argc, char **argv)
+{
+	int nconns = 1000, nflood = 0, seconds = 5, port = 8990;
+	const char *mix = "1k:70,16k:25,1m:5", *bindir = ".";
+	const char *workers = NULL, *max_conns = NULL, *baseline = NULL, *save_to = NULL;
+
+	ARGBEGIN {
+	case 'c': nconns = atoi(EARGF(usage())); break;
+	case 't': seconds = atoi(EARGF(usage())); break;
+	case 'p': port = atoi(EARGF(usage())); break;
+	case 'z': mix = EARGF(usage()); break;
+	case 'w': workers = EARGF(usage()); break;
+	case 'm': max_conns = EARGF(usage()); break;
+	case 'f': nflood = atoi(EARGF(usage())); break;
+	case 'x': bindir = EARGF(usage()); break;
+	case 'b': baseline = EARGF(usage()); break;
+	case 's': save_to = EARGF(usage()); break;
+	default:
+		usage();
+		exit(1);
+	} ARGEND
+
+	args = argv;
+	if (argc != NUM_ARGS || nconns < 1 || nflood < 0 || seconds < 1) {
+		usage();
+		exit(1);
+	}
+	parse_mix(mix);
+
+	signal(SIGPIPE, SIG_IGN);
+	raise_fd_limit(nconns + nflood + 64);
+	srand(1);
+
+#if BRICK_TLS
+	if (!(tls_cfg = tls_config_new()) || tls_config_set_ca_file(tls_cfg, args[0]) < 0) {
+		fprintf(stderr, "tls_config: %s\n", tls_cfg ? tls_config_error(tls_cfg) : "out of memory");
+		exit(1);
+	}
+	/* The certificate is made out to whatever the server is called, not necessarily localhost. */
+	tls_config_insecure_noverifyname(tls_cfg);
+#endif
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	make_docroot();
+	pid_t pid = start_server(bindir, port, workers, max_conns);
+	if (await_server() < 0) {
+		fprintf(stderr, "%s did not come up on port %d.\n", SERVER, port);
+		stop_server(pid);
+		remove_docroot();
+		exit(1);
+	}
+
+	struct result r = run(nconns, nflood, seconds);
+	stop_server(pid);
+	remove_docroot();
+
+	report(&r, baseline);
+	if (save_to) save(&r, save_to);
+	return errors || dropped ? 2 : 0;
+}
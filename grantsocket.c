@@ -5,6 +5,10 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <errno.h>
@@ -13,7 +17,8 @@
 
 #include "arg.h"
 
-#define BACKLOG 128
+#define BACKLOG    128
+#define DEFER_SECS 5
 
 char *argv0;
 
@@ -36,7 +41,7 @@ die(const char *fmt, ...)
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: %s [-d fdnum] [-s user:group] host:port cmd ...\n", argv0);
+	fprintf(stderr, "usage: %s [-d fdnum] [-n count] [-s user:group] host:port|path[,...] cmd ...\n", argv0);
 }
 
 static char *
@@ -51,8 +56,44 @@ split_arg(char *arg)
 	return pivot + 1;
 }
 
+static void
+start_listening(int fd, int tcp)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	if (listen(fd, BACKLOG) < 0) die("listen:");
+
+#ifdef TCP_DEFER_ACCEPT
+	/* Only wake the server once the client has actually sent something. */
+	const int secs = DEFER_SECS;
+	if (tcp) setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof (int));
+#else
+	(void) tcp;
+#endif
+}
+
+static int
+open_unix_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof addr.sun_path) die("%s: path too long.", path);
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) die("socket:");
+
+	/* A socket left behind by an earlier run would be in the way, but nothing else should be. */
+	struct stat meta;
+	if (lstat(path, &meta) == 0 && S_ISSOCK(meta.st_mode)) unlink(path);
+
+	if (bind(fd, (void *) &addr, sizeof addr) < 0) die("bind %s:", path);
+	start_listening(fd, 0);
+	return fd;
+}
+
 static int
-open_socket(const char *host, const char *port)
+open_socket(const char *host, const char *port, int reuseport)
 {
 	struct addrinfo hints = {
 		.ai_flags    = AI_NUMERICSERV,
@@ -70,6 +111,11 @@ open_socket(const char *host, const char *port)
 
 		const int yes = 1;
 		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (int));
+#ifdef SO_REUSEPORT
+		if (reuseport) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof (int));
+#else
+		if (reuseport) die("SO_REUSEPORT is not supported on this system.");
+#endif
 		
 		if (bind(fd, p->ai_addr, p->ai_addrlen) < 0) {
 			close(fd);
@@ -80,10 +126,7 @@ open_socket(const char *host, const char *port)
 	}
 	if (!p) die("unable to open socket.");
 
-	int flags = fcntl(fd, F_GETFL, 0);
-	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-
-	if (listen(fd, BACKLOG) < 0) die("listen:");
+	start_listening(fd, 1);
 
 	freeaddrinfo(ai);
 	return fd;
@@ -94,7 +137,7 @@ main(int argc, char **argv)
 {
 	argv0 = argv[0];
 
-	int fd = 3;
+	int fd = 3, count = 1;
 	char *user = NULL, *group = NULL;
 	ARGBEGIN {
 	case 'h':
@@ -103,6 +146,13 @@ main(int argc, char **argv)
 	case 'd':
 		fd = atoi(EARGF(usage()));
 		break;
+	case 'n':
+		count = atoi(EARGF(usage()));
+		if (count < 1) {
+			usage();
+			exit(1);
+		}
+		break;
 	case 's':
 		user = EARGF(usage());
 		group = split_arg(user);
@@ -117,12 +167,35 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
-	char *host = *argv++;
-	char *port = split_arg(host);
+	/* Every address gets its sockets on the next free descriptors, in the order given. */
+	for (char *next, *addr = *argv++; addr; addr = next) {
+		if ((next = strchr(addr, ','))) *next++ = 0;
 
-	int sock = open_socket(host, port);
-	if (dup2(sock, fd) < 0) die("dup2:");
-	if (sock != fd) close(sock);
+		if (strchr(addr, '/')) {
+			/* Unix sockets can't share a path, so all the workers have to make do with one. */
+			int sock = open_unix_socket(addr);
+			if (dup2(sock, fd) < 0) die("dup2:");
+			if (sock != fd) close(sock);
+			fd++;
+			continue;
+		}
+
+		char *host = addr;
+		char *port = split_arg(host);
+		/* Allow [::1]:80 as well as ::1:80. */
+		size_t len = strlen(host);
+		if (host[0] == '[' && len > 1 && host[len-1] == ']') {
+			host[len-1] = 0;
+			host++;
+		}
+
+		/* Several sockets sharing a port let the kernel spread connections over the workers. */
+		for (int i = 0; i < count; i++, fd++) {
+			int sock = open_socket(host, port, count > 1);
+			if (dup2(sock, fd) < 0) die("dup2:");
+			if (sock != fd) close(sock);
+		}
+	}
 
 	if (user) {
 		errno = 0;
@@ -0,0 +1,285 @@
+/* Microbenchmarks for brick's internals. brick.c is pulled in whole, so the
+ * functions measured here are exactly the ones the server runs. */
+#define main brick_main
+#include "brick.c"
+#undef main
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define cycles() __rdtsc()
+#else
+# define cycles() 0ULL
+#endif
+
+#define MIN_TIME 200000000ULL /* nanoseconds each benchmark runs for at least */
+#define BATCH    1000
+#define MAX_BENCH 64
+
+struct result {
+	char name[64];
+	double ns;
+	double cycles;
+};
+
+static struct result results[MAX_BENCH];
+static int nresults;
+static volatile size_t sink;
+
+/* Requests as they sit in the input buffer, each ending with the empty line. */
+static const struct corpus {
+	const char *name;
+	const char *text;
+} requests[] = {
+	{ "minimal", "GET / HTTP/1.1\r\nHost: a\r\n\r\n" },
+	{ "browser",
+		"GET /static/css/site.css HTTP/1.1\r\n"
+		"Host: www.example.org\r\n"
+		"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+		"Accept: text/css,*/*;q=0.1\r\n"
+		"Accept-Language: en-US,en;q=0.5\r\n"
+		"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+		"Referer: https://www.example.org/blog/2024/some-article.html\r\n"
+		"Connection: keep-alive\r\n"
+		"Sec-Fetch-Dest: style\r\n"
+		"Sec-Fetch-Mode: no-cors\r\n"
+		"Sec-Fetch-Site: same-origin\r\n"
+		"If-Modified-Since: Tue, 15 Oct 2024 08:12:31 GMT\r\n"
+		"If-None-Match: \"17f3a2b4c5d6e7f8-4d2\"\r\n"
+		"Priority: u=2\r\n"
+		"\r\n" },
+	{ "range",
+		"GET /video/talk.mp4 HTTP/1.1\r\n"
+		"Host: media.example.org\r\n"
+		"Range: bytes=1048576-2097151\r\n"
+		"If-Range: \"17f3a2b4c5d6e7f8-9a1b2c3\"\r\n"
+		"\r\n" },
+	{ "long-path",
+		"GET /archive/2024/10/15/a/very/deeply/nested/directory/structure/that/goes/on/and/on/"
+		"for/quite/a/while/until/it/finally/reaches/the/file/we/actually/wanted/all-along.html HTTP/1.1\r\n"
+		"Host: www.example.org\r\n"
+		"\r\n" },
+	{ "many-headers",
+		"GET /index.html HTTP/1.1\r\n"
+		"Host: www.example.org\r\n"
+		"X-Header-00: some value\r\nX-Header-01: some value\r\nX-Header-02: some value\r\n"
+		"X-Header-03: some value\r\nX-Header-04: some value\r\nX-Header-05: some value\r\n"
+		"X-Header-06: some value\r\nX-Header-07: some value\r\nX-Header-08: some value\r\n"
+		"X-Header-09: some value\r\nX-Header-10: some value\r\nX-Header-11: some value\r\n"
+		"X-Header-12: some value\r\nX-Header-13: some value\r\nX-Header-14: some value\r\n"
+		"X-Header-15: some value\r\nX-Header-16: some value\r\nX-Header-17: some value\r\n"
+		"X-Header-18: some value\r\nX-Header-19: some value\r\nX-Header-20: some value\r\n"
+		"X-Header-21: some value\r\nX-Header-22: some value\r\nX-Header-23: some value\r\n"
+		"X-Header-24: some value\r\nX-Header-25: some value\r\nX-Header-26: some value\r\n"
+		"X-Header-27: some value\r\nX-Header-28: some value\r\nX-Header-29: some value\r\n"
+		"Accept-Encoding: br\r\n"
+		"\r\n" },
+	{ "hostile-colons",
+		"GET /index.html HTTP/1.1\r\n"
+		"Host: a:b:c:d:e:f:g:h:i:j:k:l:m:n:o:p:q:r:s:t:u:v:w:x:y:z\r\n"
+		"Hostx: a\r\nHos: a\r\nHOST: a\r\nhost : a\r\n:::::::::::::::::::::::::::::::\r\n"
+		"\r\n" },
+	{ "hostile-bare-cr", "GET /index.html HTTP/1.1\r\nHost: a\rb\r\nRange: bytes=0-1\r\n\r\n" },
+	{ "hostile-version", "GET /index.html HTTP/1.0\r\nHost: a\r\n\r\n" },
+};
+
+static const struct corpus paths[] = {
+	{ "root",      "/" },
+	{ "short",     "/index.html" },
+	{ "typical",   "/static/css/site.css" },
+	{ "slashes",   "//a///b////c/////index.html" },
+	{ "long",      "/archive/2024/10/15/a/very/deeply/nested/directory/structure/that/goes/on/and/on/"
+		"for/quite/a/while/until/it/finally/reaches/the/file/we/actually/wanted/all-along.html" },
+	{ "traversal", "/../../../etc/passwd" },
+	{ "dotfile",   "/a/b/c/.hidden/x" },
+};
+
+/* A request copied into a buffer of its own, which parse_http() may scribble on. */
+struct prepared {
+	char buf[SCRATCH];
+	size_t len;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs fn in batches until enough time has passed and records the cost of one call. */
+static void
+bench(const char *group, const char *name, void (*fn)(const void *), const void *arg)
+{
+	uint64_t iters = 0, t0 = now_ns(), c0 = cycles(), t1;
+	do {
+		for (int i = 0; i < BATCH; i++) fn(arg);
+		iters += BATCH;
+	} while ((t1 = now_ns()) - t0 < MIN_TIME);
+	uint64_t c1 = cycles();
+
+	if (nresults == MAX_BENCH) return;
+	struct result *r = &results[nresults++];
+	snprintf(r->name, sizeof r->name, "%s/%s", group, name);
+	r->ns = (double) (t1 - t0) / iters;
+	r->cycles = (double) (c1 - c0) / iters;
+}
+
+static void
+run_parse(const void *arg)
+{
+	struct prepared *p = (struct prepared *) arg;
+	sink += parse_http(p->buf, p->len);
+	unparse_http(p->buf);
+}
+
+static void
+run_sanitize(const void *arg)
+{
+	char path[MAX_PATH];
+	strcpy(path, arg);
+	sink += sanitize_path(path);
+}
+
+static void
+run_mime(const void *arg)
+{
+	const char *path = arg;
+	sink += (size_t) mime_type(path, strlen(path));
+}
+
+static void
+run_evict(const void *arg)
+{
+	(void) arg;
+	sink += evict();
+}
+
+/* Fills the connection table the way a particular kind of load would. */
+static void
+setup_conns(int n, int nclients, int heavy)
+{
+	free(conns);
+	free(peers);
+	free(live);
+	free(clients);
+	free(client_table);
+	free(by_count);
+	max_conns = n;
+	alloc_conns();
+
+	for (nconns = 0; nconns < n; nconns++) {
+		int i = nconns;
+		/* The heavy client holds the first `heavy` connections, the rest spread out evenly. */
+		uint32_t client = i < heavy ? 0 : 1 + (uint32_t) i % nclients;
+		struct sockaddr_in *sin = (void *) &peers[i].addr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(0x0a000000 | client);
+		conns[i].phase = i % 7 ? REQUEST : i % 3 ? RESPONSE : PAYLOAD;
+		/* Flooding connections that sent a partial request, none of them empty. */
+		conns[i].in_len = 1 + i % 300;
+		conns[i].length = 1000;
+		conns[i].offset = i % 1000;
+		conns[i].content_length = i * 4096;
+		attach_client(i);
+	}
+}
+
+static void
+load_baseline(const char *path, struct result *base, int *nbase)
+{
+	FILE *f = fopen(path, "r");
+	*nbase = 0;
+	if (!f) return;
+	while (*nbase < MAX_BENCH && fscanf(f, "%63s %lf %lf",
+		base[*nbase].name, &base[*nbase].ns, &base[*nbase].cycles) == 3) (*nbase)++;
+	fclose(f);
+}
+
+static void
+save_results(const char *path)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "fopen %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	for (int i = 0; i < nresults; i++) {
+		fprintf(f, "%s %.2f %.1f\n", results[i].name, results[i].ns, results[i].cycles);
+	}
+	fclose(f);
+}
+
+static void
+print_results(const struct result *base, int nbase)
+{
+	printf("%-32s %10s %12s %10s\n", "benchmark", "ns/op", "cycles/op", "vs base");
+	for (int i = 0; i < nresults; i++) {
+		const struct result *r = &results[i];
+		char delta[16] = "";
+		for (int k = 0; k < nbase; k++) {
+			if (strcmp(base[k].name, r->name)) continue;
+			snprintf(delta, sizeof delta, "%+.1f%%", (r->ns - base[k].ns) / base[k].ns * 100);
+			break;
+		}
+		printf("%-32s %10.2f %12.1f %10s\n", r->name, r->ns, r->cycles, delta);
+	}
+}
+
+static void
+bench_usage(void)
+{
+	fprintf(stderr, "usage: %s [-b baseline-file] [-s save-file]\n", argv0);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *baseline = NULL, *save = NULL;
+
+	ARGBEGIN {
+	case 'b':
+		baseline = EARGF(bench_usage());
+		break;
+	case 's':
+		save = EARGF(bench_usage());
+		break;
+	default:
+		bench_usage();
+		exit(1);
+	} ARGEND
+
+	setlocale(LC_ALL, "C");
+	init_key_slots();
+
+	for (size_t i = 0; i < sizeof requests / sizeof *requests; i++) {
+		static struct prepared p;
+		size_t n = strlen(requests[i].text);
+		memcpy(p.buf, requests[i].text, n);
+		/* Like process_conn(), hand over everything up to the CRLF before the empty line. */
+		p.len = (char *) memmem(p.buf, n, "\r\n\r\n", 4) + 2 - p.buf;
+		bench("parse_http", requests[i].name, run_parse, &p);
+	}
+	for (size_t i = 0; i < sizeof paths / sizeof *paths; i++) {
+		bench("sanitize_path", paths[i].name, run_sanitize, paths[i].text);
+	}
+	bench("mime_type", "html", run_mime, "blog/index.html");
+	bench("mime_type", "webm", run_mime, "video/talk.webm");
+	bench("mime_type", "unknown", run_mime, "bin/blob.unknownext");
+
+	setup_conns(1000, 1000, 0);
+	bench("evict", "1000-distinct", run_evict, NULL);
+	setup_conns(1000, 50, 0);
+	bench("evict", "1000-by-50", run_evict, NULL);
+	setup_conns(1000, 10, 500);
+	bench("evict", "1000-one-heavy", run_evict, NULL);
+	setup_conns(100000, 100, 20000);
+	bench("evict", "100000-one-heavy", run_evict, NULL);
+
+	struct result base[MAX_BENCH];
+	int nbase = 0;
+	if (baseline) load_baseline(baseline, base, &nbase);
+	print_results(base, nbase);
+	if (save) save_results(save);
+	return 0;
+}